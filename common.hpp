@@ -12,32 +12,103 @@
 #include<string>
 #include<string.h>
 #include<algorithm>
+#include<limits>
+#include<cstdlib>
+#include<cstdint>
+#include<new>
+#include<mutex>
+#include<atomic>
 
 #include "csv.h"
 
-constexpr std::size_t CPU_COUNT = 4;
-constexpr int MAX_N = 300;
+constexpr std::size_t MIN_SCHEDULES = 4;  // DP runs, more with more cores
+constexpr std::size_t SCHEDULE_CORES = 4;  // sharding the layers of a run
+constexpr int MAX_N = 512;
 constexpr int NO_ARC = -1;
 
+// set once the searches should stop and hand over their tours
+std::atomic<bool> TERMINATE{false};
+
 typedef long cost_t;
 typedef unsigned short cid_t;  // city id or day number (the same range)
-typedef std::vector<std::vector<std::vector<cost_t>>> costs_table_t;
 
-constexpr int FORWARD = 1;
-constexpr int BACKWARD = 0;
+// print statistics useful for tuning to stderr
+#if defined(DEBUG) || defined(STATS)
+constexpr bool PRINT_STATS = true;
+#else
+constexpr bool PRINT_STATS = false;
+#endif
 
-const std::vector<std::vector<int>> DIRECTIONS = {
-  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
-  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-  { 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0},
-  { 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1},
-  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
-  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-  { 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
-  { 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1}
-  // ...
+// acceptance policies of the local search (random_perturbations.hpp)
+constexpr int ACCEPT_GREEDY = 0;
+constexpr int ACCEPT_ANNEAL = 1;
+constexpr int ACCEPT_LATE = 2;
+
+// command line options, all of them optional
+struct Options {
+    bool batch_select = false;  // --batch: select beams in bulk (BatchKeeper)
+    unsigned int dp_threads = 0;  // --dp-threads N: threads per DP layer
+    double dp_fraction = 0.6;  // --dp-fraction F: part of the time for the DP
+    unsigned int max_beam = 0;  // --max-beam N: upper bound of the DP beam width
+    int dense = -1;  // --kernel sparse|dense: how to expand, -1 for by density
+    bool bound = false;  // --bound: rank pts by cost plus a bound of the rest
+    bool sweep = false;  // --sweep: print the DP tour cost for growing beam widths
+    bool meet = false;  // --meet: forward and backward DP meeting in the middle
+    unsigned int threads = 0;  // --threads N: workers of the pool, 0 for all cores
+    unsigned int schedules = 0;  // --schedules N: DP runs, 0 by the cores
+    int accept = ACCEPT_ANNEAL;  // --accept greedy|anneal|late: of the local search
+    unsigned int windows = 1;  // --windows N: local searches reordering windows exactly
+    bool heuristic = false;  // --heuristic: no exact Held-Karp even if it fits (held_karp.hpp)
+    double gap = 0;  // --gap F: stop once the best tour is within F * lower bound, < 0 never
 };
 
+// return false on an unknown option
+bool parse_options(int argc, char * argv[], Options & options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--batch") {
+            options.batch_select = true;
+        } else if (arg == "--dp-threads" && i + 1 < argc) {
+            options.dp_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--dp-fraction" && i + 1 < argc) {
+            options.dp_fraction = std::min(1.0, std::max(0.0, std::atof(argv[++i])));
+        } else if (arg == "--max-beam" && i + 1 < argc) {
+            options.max_beam = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--kernel" && i + 1 < argc) {
+            const std::string kernel = argv[++i];
+            options.dense = kernel == "dense" ? 1 : kernel == "sparse" ? 0 : -1;
+        } else if (arg == "--bound") {
+            options.bound = true;
+        } else if (arg == "--sweep") {
+            options.sweep = true;
+        } else if (arg == "--meet") {
+            options.meet = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--schedules" && i + 1 < argc) {
+            options.schedules = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--accept" && i + 1 < argc) {
+            const std::string accept = argv[++i];
+            options.accept = accept == "greedy" ? ACCEPT_GREEDY :
+                accept == "late" ? ACCEPT_LATE : ACCEPT_ANNEAL;
+        } else if (arg == "--heuristic") {
+            options.heuristic = true;
+        } else if (arg == "--gap" && i + 1 < argc) {
+            options.gap = std::atof(argv[++i]);
+        } else if (arg == "--windows" && i + 1 < argc) {
+            options.windows = std::max(0, std::atoi(argv[++i]));
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr int FORWARD = 1;
+constexpr int BACKWARD = 0;
+
 
 // Class storing city code to index mapping
 class Cities {
@@ -98,15 +169,267 @@ struct IOArc {
 typedef std::vector<IOArc> output_t;
 
 
-void init_from_input(cid_t & start, Cities & cities, costs_table_t & costs)
+// Minimal allocator returning memory aligned to ALIGN bytes, so that the
+// big tables start on a cache line (and on a SIMD register boundary).
+template<typename T, std::size_t ALIGN = 64>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    template<typename U> struct rebind { typedef AlignedAllocator<U, ALIGN> other; };
+
+    AlignedAllocator() = default;
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, ALIGN> &) {}
+
+    T * allocate(std::size_t count)
+    {
+        void * ptr = nullptr;
+        if (posix_memalign(&ptr, ALIGN, count * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T * ptr, std::size_t)
+    {
+        free(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, ALIGN> &) const { return true; }
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, ALIGN> &) const { return false; }
+};
+
+template<typename T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+
+// One arc of an ArcIndex list: the other end of the arc and its cost.
+template<typename T>
+struct Arc {
+    cid_t city;
+    T cost;
+};
+
+
+// Compressed sparse row (or column) index of the existing arcs of a
+// CostTable.
+//
+// For each (day, city) pair it lists only the arcs which are not NO_ARC, in
+// increasing order of the other end. Depending on the builder, `city` is the
+// source (`outgoing`) or the target (`incoming`) of the listed arcs. The
+// lists of all the pairs are stored one after another in `arcs_`,
+// `begin_[day*n + city]` is the start of the list of the pair.
+template<typename T>
+class ArcIndex {
+    cid_t n_ = 0;
+    std::vector<unsigned int> begin_;
+    std::vector<Arc<T>> arcs_;
+
+public:
+    struct Range {
+        const Arc<T> * first;
+        const Arc<T> * last;
+
+        const Arc<T> * begin() const { return first; }
+        const Arc<T> * end() const { return last; }
+        std::size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+        const Arc<T> & operator[](std::size_t i) const { return first[i]; }
+    };
+
+    ArcIndex() = default;
+
+    // arcs leaving `from` on `day`
+    template<typename costs_t>
+    static ArcIndex outgoing(const costs_t & costs)
+    {
+        ArcIndex index;
+        const cid_t n = costs.size();
+        index.n_ = n;
+        index.begin_.reserve(std::size_t(n) * n + 1);
+        for (cid_t day = 0; day < n; ++day) {
+            for (cid_t from = 0; from < n; ++from) {
+                index.begin_.push_back(index.arcs_.size());
+                const auto * row = costs.row(day, from);
+                for (cid_t to = 0; to < n; ++to) {
+                    if (row[to] != NO_ARC) {
+                        index.arcs_.push_back(Arc<T>{to, row[to]});
+                    }
+                }
+            }
+        }
+        index.begin_.push_back(index.arcs_.size());
+        return index;
+    }
+
+    // arcs entering `to` on `day` (the transposed table, built once so that
+    // backward steps do not walk the columns of the cost table)
+    template<typename costs_t>
+    static ArcIndex incoming(const costs_t & costs)
+    {
+        ArcIndex index;
+        const cid_t n = costs.size();
+        index.n_ = n;
+        index.begin_.reserve(std::size_t(n) * n + 1);
+        for (cid_t day = 0; day < n; ++day) {
+            for (cid_t to = 0; to < n; ++to) {
+                index.begin_.push_back(index.arcs_.size());
+                for (cid_t from = 0; from < n; ++from) {
+                    const T cost = costs(day, from, to);
+                    if (cost != NO_ARC) {
+                        index.arcs_.push_back(Arc<T>{from, cost});
+                    }
+                }
+            }
+        }
+        index.begin_.push_back(index.arcs_.size());
+        return index;
+    }
+
+    Range operator()(cid_t day, cid_t city) const
+    {
+        const std::size_t i = std::size_t(day) * n_ + city;
+        return Range{arcs_.data() + begin_[i], arcs_.data() + begin_[i+1]};
+    }
+
+    std::size_t size() const
+    {
+        return arcs_.size();
+    }
+};
+
+
+// Dense costs[day][from][to] table stored in one contiguous aligned block.
+//
+// The element type T is as narrow as the input allows (see
+// `fits_cost_width`), costs of missing arcs are NO_ARC. Each (day, from) row
+// is padded to a multiple of 64 bytes, the padding is filled with NO_ARC so
+// that whole rows can be scanned without bounds checks.
+template<typename T>
+class CostTable {
+    cid_t n_ = 0;
+    std::size_t stride_ = 0;  // number of elements in one padded row
+    aligned_vector<T> data_;
+
+public:
+    typedef T value_type;
+    typedef ArcIndex<T> arcs_t;
+
+    CostTable() = default;
+    CostTable(cid_t n) :
+        n_(n),
+        stride_((n * sizeof(T) + 63) / 64 * 64 / sizeof(T)),
+        data_(std::size_t(n) * n * stride_, NO_ARC)
+    {}
+
+    T operator()(cid_t day, cid_t from, cid_t to) const
+    {
+        return data_[(std::size_t(day) * n_ + from) * stride_ + to];
+    }
+
+    T & operator()(cid_t day, cid_t from, cid_t to)
+    {
+        return data_[(std::size_t(day) * n_ + from) * stride_ + to];
+    }
+
+    // all the arcs from `from` on `day`, indexed by destination
+    const T * row(cid_t day, cid_t from) const
+    {
+        return &data_[(std::size_t(day) * n_ + from) * stride_];
+    }
+
+    cid_t size() const
+    {
+        return n_;
+    }
+
+    std::size_t stride() const
+    {
+        return stride_;
+    }
+
+    std::size_t bytes() const
+    {
+        return data_.size() * sizeof(T);
+    }
+
+    // the table with `from` and `to` swapped
+    CostTable transposed() const
+    {
+        CostTable table(n_);
+        for (cid_t day = 0; day < n_; ++day) {
+            for (cid_t from = 0; from < n_; ++from) {
+                const T * src = row(day, from);
+                for (cid_t to = 0; to < n_; ++to) {
+                    table(day, to, from) = src[to];
+                }
+            }
+        }
+        return table;
+    }
+};
+
+
+// The arcs in all the representations the search uses.
+template<typename costs_t>
+struct Graph {
+    costs_t costs;
+    costs_t costs_T;  // costs_T(day, to, from), only built for dense graphs
+    typename costs_t::arcs_t out_arcs;
+    typename costs_t::arcs_t in_arcs;
+    // expand partial tours by scanning the dense rows with the vectorized
+    // kernels (expand.hpp) rather than by following the arc lists
+    bool dense = false;
+};
+
+
+// The best complete tour found so far, offered by the DP runs as they go.
+// Offers which are not better are rejected without locking.
+class Incumbent {
+    std::mutex mutex;
+    std::atomic<cost_t> best_cost{std::numeric_limits<cost_t>::max()};
+    std::vector<cid_t> best_tour;
+
+public:
+    cost_t cost() const
+    {
+        return best_cost.load();
+    }
+
+    // keep `tour` if it is the best so far, return whether it is
+    bool offer(const std::vector<cid_t> & tour, cost_t cost)
+    {
+        if (cost >= best_cost.load()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cost >= best_cost.load()) {
+            return false;
+        }
+        best_tour = tour;
+        best_cost.store(cost);
+        return true;
+    }
+
+    // a copy of the best tour, empty if there is none
+    std::vector<cid_t> tour()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return best_tour;
+    }
+};
+
+
+// Read the whole input, city indices are assigned in order of appearance.
+void read_input(cid_t & start, Cities & cities, std::vector<IOArc> & input_arcs)
 {
     io::CSVReader<4, io::trim_chars<>, io::no_quote_escape<' '>> in("stdin", stdin);
 
     std::string start_str = in.next_line();
     start = cities.code2idx(std::move(start_str));
 
-    std::vector<IOArc> input_arcs;
-
     std::string from; std::string to; cid_t day{}; cost_t price{};
     // save all the lines to input_arcs
     while (in.read_row(from, to, day, price)) {
@@ -119,26 +442,57 @@ void init_from_input(cid_t & start, Cities & cities, costs_table_t & costs)
 
         input_arcs.emplace_back(std::move(a));
     }
+}
+
+
+// can all the prices be stored in T (next to NO_ARC)?
+template<typename T>
+bool fits_cost_width(const std::vector<IOArc> & input_arcs)
+{
+    for (const auto & a : input_arcs) {
+        if (a.price < 0 || a.price > std::numeric_limits<T>::max()) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    int n = cities.size();
 
-    // costs[day][from][to] -> cost_t 
-    costs = costs_table_t(
-        n, std::vector<std::vector<cost_t>>(n, std::vector<cost_t>(n, NO_ARC))
-    );
+template<typename costs_t>
+void init_from_input(cid_t n,
+                     cid_t start,
+                     const std::vector<IOArc> & input_arcs,
+                     costs_t & costs)
+{
+    typedef typename costs_t::value_type value_t;
+
+    // costs(day, from, to) -> cost
+    costs = costs_t(n);
 
     for (const auto & a : input_arcs) {
-        cost_t & cost = costs[a.day][a.from][a.to];
+        value_t & cost = costs(a.day, a.from, a.to);
         if (cost == NO_ARC || cost > a.price) {
             // visits to start allowed only in the last day
             if (a.day == n-1 || a.to != start) {
-                cost = a.price;
+                cost = static_cast<value_t>(a.price);
             }
         }
     }
 }
 
 
+// cost of a tour given as the sequence of the n+1 cities visited
+template<typename costs_t>
+cost_t tour_cost(const costs_t & costs, const std::vector<cid_t> & tour)
+{
+    cost_t cost = 0;
+    for (std::size_t t = 0; t + 1 < tour.size(); ++t) {
+        cost += costs(t, tour[t], tour[t+1]);
+    }
+    return cost;
+}
+
+
 cost_t final_cost(const output_t & arcs)
 {
     cost_t cost = 0;
@@ -181,29 +535,79 @@ void print_output(output_t & output_arcs,
 }
 
 
-// iteratively remove arcs which cannot be used to reach start
-void prune_costs(cid_t n, cid_t start, costs_table_t & costs)
+// Remove all the arcs which cannot lie on any tour, return their number.
+//
+// An arc (day, from, to) can be used only if `from` can be reached from
+// start in exactly `day` flights and start can be reached from `to` in the
+// remaining n-day-1 flights. Both reachability sets are computed for every
+// day with word-parallel ORs of adjacency bit rows:
+//   forw[day+1] = OR of out_bits[day][from] over from in forw[day]
+//   back[day]   = OR of in_bits[day][to] over to in back[day+1]
+template<typename costs_t>
+std::size_t prune_costs(cid_t n, cid_t start, costs_t & costs)
 {
-    std::vector<std::vector<char>> can_reach(n+1, std::vector<char>(n, 0));
-    can_reach[n][start] = 1;
-    bool not_all_can = true;
-    for (cid_t t = n; t >= 1 && not_all_can; t--) {
-        int pruned = 0;
-        for (cid_t from = 0; from < n && not_all_can; from++) {
-            for (cid_t to = 0; to < n; to++) {
-                if (can_reach[t][to] && costs[t-1][from][to] > NO_ARC) {
-                    can_reach[t-1][from] = 1;
+    typedef std::uint64_t word_t;
+    const std::size_t W = (n + 63) / 64;  // words per bit row
+
+    // out_bits[(day*n + from)*W ..] = set of `to`s, in_bits symmetrically
+    std::vector<word_t> out_bits(std::size_t(n) * n * W, 0);
+    std::vector<word_t> in_bits(std::size_t(n) * n * W, 0);
+    for (cid_t day = 0; day < n; ++day) {
+        for (cid_t from = 0; from < n; ++from) {
+            const auto * row = costs.row(day, from);
+            for (cid_t to = 0; to < n; ++to) {
+                if (row[to] != NO_ARC) {
+                    out_bits[(std::size_t(day) * n + from) * W + to / 64] |= word_t(1) << (to % 64);
+                    in_bits[(std::size_t(day) * n + to) * W + from / 64] |= word_t(1) << (from % 64);
                 }
             }
-            if (!can_reach[t-1][from]) {
-                pruned++;
-                for (cid_t to = 0; to < n; to++) {
-                    costs[t-1][from][to] = NO_ARC;
+        }
+    }
+
+    auto test = [](const word_t * bits, cid_t i) {
+        return (bits[i / 64] >> (i % 64)) & 1;
+    };
+    // dst |= OR of rows[(day*n + i)*W ..] for i in src
+    auto propagate = [n, W](const std::vector<word_t> & rows, cid_t day,
+                            const word_t * src, word_t * dst) {
+        for (std::size_t w = 0; w < W; ++w) {
+            for (word_t bits = src[w]; bits; bits &= bits - 1) {
+                const std::size_t i = w * 64 + __builtin_ctzll(bits);
+                const word_t * row = &rows[(std::size_t(day) * n + i) * W];
+                for (std::size_t v = 0; v < W; ++v) {
+                    dst[v] |= row[v];
+                }
+            }
+        }
+    };
+
+    // forw[day*W ..] = cities where a walk from start can be after day flights
+    std::vector<word_t> forw((std::size_t(n) + 1) * W, 0);
+    forw[start / 64] |= word_t(1) << (start % 64);
+    for (cid_t day = 0; day < n; ++day) {
+        propagate(out_bits, day, &forw[day * W], &forw[(day + 1) * W]);
+    }
+    // back[day*W ..] = cities from which start can be reached in n-day flights
+    std::vector<word_t> back((std::size_t(n) + 1) * W, 0);
+    back[n * W + start / 64] |= word_t(1) << (start % 64);
+    for (cid_t day = n; day >= 1; --day) {
+        propagate(in_bits, day - 1, &back[day * W], &back[(day - 1) * W]);
+    }
+
+    std::size_t pruned = 0;
+    for (cid_t day = 0; day < n; ++day) {
+        for (cid_t from = 0; from < n; ++from) {
+            const bool from_ok = test(&forw[day * W], from);
+            for (cid_t to = 0; to < n; ++to) {
+                auto & cost = costs(day, from, to);
+                if (cost != NO_ARC && !(from_ok && test(&back[(day + 1) * W], to))) {
+                    cost = NO_ARC;
+                    pruned++;
                 }
-                not_all_can = true;
             }
         }
     }
+    return pruned;
 }
 
 
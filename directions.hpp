@@ -0,0 +1,137 @@
+#ifndef DIRECTIONS_HPP_
+#define DIRECTIONS_HPP_
+
+#include<vector>
+#include<random>
+
+#include "common.hpp"
+
+
+/* DP schedules
+ *
+ * A schedule gives the direction of every layer of the DP: directions[l] is
+ * FORWARD if layer l prolongs the pts at the forward end (on the first day
+ * not yet flown from the start) and BACKWARD if at the backward end (on the
+ * last day not yet flown back to the start). There are n layers, the last
+ * one closes the tours. Different schedules make the beams keep different
+ * pts, so every DP run should get a different one.
+ */
+
+
+// k steps in one direction, then k in the other and so on, starting with
+// `first`. k >= n means all the steps in the direction `first`.
+std::vector<int> block_directions(int n, int k, int first)
+{
+    k = std::max(1, k);
+    std::vector<int> directions(n);
+    for (int l = 0; l < n; l++) {
+        directions[l] = (l / k) % 2 == 0 ? first : 1 - first;
+    }
+    return directions;
+}
+
+
+// every step in a random direction
+std::vector<int> random_directions(int n, std::mt19937 & g)
+{
+    std::bernoulli_distribution coin(0.5);
+    std::vector<int> directions(n);
+    for (int l = 0; l < n; l++) {
+        directions[l] = coin(g) ? FORWARD : BACKWARD;
+    }
+    return directions;
+}
+
+
+// The mean cost of the cheapest arc leaving a city on a day, over the
+// cities which have any, for every day.
+template<typename costs_t>
+std::vector<double> day_costs(int n, const Graph<costs_t> & graph)
+{
+    std::vector<double> day_cost(n, 0);
+    for (int day = 0; day < n; day++) {
+        double sum = 0;
+        int cities = 0;
+        for (int city = 0; city < n; city++) {
+            const auto arcs = graph.out_arcs(day, city);
+            if (arcs.empty()) {
+                continue;
+            }
+            cost_t cheapest = arcs.begin()->cost;
+            for (const auto & arc : arcs) {
+                cheapest = std::min<cost_t>(cheapest, arc.cost);
+            }
+            sum += cheapest;
+            cities++;
+        }
+        day_cost[day] = cities ? sum / cities : 0;
+    }
+    return day_cost;
+}
+
+
+// Every step at the end whose next day looks cheaper (by `day_cost`), with
+// the probability of going forward cb / (cf + cb) for the costs cf and cb of
+// the next forward and backward day.
+std::vector<int> biased_directions(int n, const std::vector<double> & day_cost, std::mt19937 & g)
+{
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<int> directions(n);
+    int f_steps = 0;
+    int b_steps = 0;
+    for (int l = 0; l < n; l++) {
+        const double cf = day_cost[f_steps];
+        const double cb = day_cost[n-1-b_steps];
+        const double p = cf + cb > 0 ? cb / (cf + cb) : 0.5;
+        if (uniform(g) < p) {
+            directions[l] = FORWARD;
+            f_steps++;
+        } else {
+            directions[l] = BACKWARD;
+            b_steps++;
+        }
+    }
+    return directions;
+}
+
+
+// `count` schedules for n cities. The block patterns come first: all
+// forward, all backward, alternating by one step (both ways), the halves
+// (both ways) and alternating by five steps (both ways). The rest alternate
+// between random schedules and ones biased toward the cheaper end. The
+// random ones are seeded by `seed`, so the schedules are reproducible.
+template<typename costs_t>
+std::vector<std::vector<int>> direction_schedules(int n,
+                                                  std::size_t count,
+                                                  const Graph<costs_t> & graph,
+                                                  unsigned int seed = 0)
+{
+    const int half = (n + 1) / 2;
+    std::vector<std::vector<int>> schedules = {
+        block_directions(n, n, FORWARD),
+        block_directions(n, n, BACKWARD),
+        block_directions(n, 1, FORWARD),
+        block_directions(n, 1, BACKWARD),
+        block_directions(n, half, BACKWARD),
+        block_directions(n, half, FORWARD),
+        block_directions(n, 5, FORWARD),
+        block_directions(n, 5, BACKWARD),
+    };
+    if (count <= schedules.size()) {
+        schedules.resize(count);
+        return schedules;
+    }
+    std::mt19937 g(seed);
+    const std::vector<double> day_cost = day_costs(n, graph);
+    while (schedules.size() < count) {
+        if (schedules.size() % 2 == 0) {
+            schedules.push_back(random_directions(n, g));
+        } else {
+            schedules.push_back(biased_directions(n, day_cost, g));
+        }
+    }
+    return schedules;
+}
+
+#endif
+// vim: set tabstop=4 expandtab shiftwidth=4 softtabstop=4 shiftround
@@ -1,128 +1,443 @@
 #ifndef DP_HEURISTIC_HPP_
 #define DP_HEURISTIC_HPP_
 
-#include<bitset>
-#include<unordered_map>
-#include<memory>
+#include<random>
+#include<cstdint>
+#include<numeric>
 
-// http://stackoverflow.com/a/7222201/4786205
-template <class T>
-inline void hash_combine(std::size_t & seed, const T & v)
-{
-    std::hash<T> hasher;
-    seed ^= hasher(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-}
+#include "expand.hpp"
+#include "thread_pool.hpp"
 
-namespace std
-{
-    template<typename S, typename T> struct hash<pair<S, T>>
+
+// Zobrist keys of the cities: the hash of a set of cities is the xor of the
+// keys of its members, so it can be updated in O(1) when a city is added.
+const std::vector<std::uint64_t> ZOBRIST = []() {
+    std::mt19937_64 gen(0x5eed);
+    std::vector<std::uint64_t> keys(MAX_N);
+    for (auto & key : keys) {
+        key = gen();
+    }
+    return keys;
+}();
+
+
+// Back-pointers of all the layers of the beam search, stored in one arena
+// preallocated for the whole search.
+//
+// Layer l holds one node per partial tour kept after l steps: the city
+// added to it by the last step and the index of the partial tour it
+// prolonged in layer l-1. Nodes of a layer are indexed the same as the
+// partial tours in the Keeper, so a slot of a partial tour evicted from the
+// Keeper is simply overwritten.
+class Trail {
+
+    struct Node {
+        unsigned int parent;
+        cid_t city;
+    };
+
+    unsigned int H;  // stride of the layers
+    std::vector<Node> nodes;  // layer l is at [l*H, (l+1)*H)
+
+public:
+    Trail(cid_t layers, unsigned int H) :
+        H(H),
+        nodes(std::size_t(layers) * H)
+    {}
+
+    static std::size_t bytes_per_pt(cid_t layers)
+    {
+        return layers * sizeof(Node);
+    }
+
+    // remember the partial tours kept after `layer` steps, the last of which
+    // prolonged them at the forward (or backward) end
+    template<typename beam_t>
+    void record(cid_t layer, const beam_t & partials, bool forward)
     {
-        inline size_t operator()(const pair<S, T> & v) const
-        {
-            size_t seed = 0;
-            ::hash_combine(seed, v.first);
-            ::hash_combine(seed, v.second);
-            return seed;
+        Node * dst = &nodes[std::size_t(layer) * H];
+        const auto & ends = forward ? partials.forw : partials.back;
+        for (unsigned int i = 0; i < partials.size(); i++) {
+            dst[i] = Node{partials.parent[i], ends[i]};
         }
-    };
+    }
+
+    // Walk the back-pointers from partial tour `idx` of the last recorded
+    // layer (`layers`) to the root and put the whole tour starting and
+    // ending in `start` into `tour`.
+    void tour(cid_t start,
+              cid_t layers,
+              unsigned int idx,
+              const std::vector<int> & directions,
+              std::vector<cid_t> & tour) const
+    {
+        const cid_t f_steps = std::count(directions.begin(), directions.begin() + layers, FORWARD);
+        tour.assign(std::size_t(layers) + 2, start);
+        // the forward part is met from its last city, the backward part
+        // from the one nearest the middle
+        std::size_t f = f_steps;
+        std::size_t b = f_steps + 1;
+        for (cid_t l = layers; l >= 1; --l) {
+            const Node & node = nodes[std::size_t(l) * H + idx];
+            if (directions[l-1] == FORWARD) {
+                tour[f--] = node.city;
+            } else {
+                tour[b++] = node.city;
+            }
+            idx = node.parent;
+        }
+    }
+
+    std::vector<cid_t> tour(cid_t start,
+                            cid_t layers,
+                            unsigned int idx,
+                            const std::vector<int> & directions) const
+    {
+        std::vector<cid_t> whole;
+        tour(start, layers, idx, directions, whole);
+        return whole;
+    }
+};
+
+
+// Set of cities as N bits, like std::bitset, but with access to the words so
+// that the expansion kernels can test whole blocks of cities at once.
+template<std::size_t N>
+class CitySet {
+    static constexpr std::size_t W = (N + 63) / 64;
+    std::uint64_t w[W] = {};
+
+public:
+    bool operator[](std::size_t i) const
+    {
+        return (w[i / 64] >> (i % 64)) & 1;
+    }
+
+    void set(std::size_t i)
+    {
+        w[i / 64] |= std::uint64_t(1) << (i % 64);
+    }
+
+    void reset(std::size_t i)
+    {
+        w[i / 64] &= ~(std::uint64_t(1) << (i % 64));
+    }
+
+    bool none() const
+    {
+        std::uint64_t any = 0;
+        for (std::size_t i = 0; i < W; ++i) {
+            any |= w[i];
+        }
+        return !any;
+    }
+
+    CitySet operator^(const CitySet & other) const
+    {
+        CitySet result;
+        for (std::size_t i = 0; i < W; ++i) {
+            result.w[i] = w[i] ^ other.w[i];
+        }
+        return result;
+    }
+
+    bool operator==(const CitySet & other) const
+    {
+        return std::equal(w, w + W, other.w);
+    }
+
+    const std::uint64_t * words() const
+    {
+        return w;
+    }
+};
+
+
+// The partial tours (pts) of one layer of the beam search, stored as a
+// structure of arrays, so that the expansion and the selection passes only
+// pull the fields they need through the cache.
+//
+// N is the capacity of the visited sets, the smallest of 64, 128, 256 and 512
+// fitting all the cities is used, so that small instances copy and compare
+// just one or two words per set.
+//
+// All the arrays are allocated for `capacity` pts up front. A layer is built
+// into one Beam while the previous layer is read from another and the two are
+// swapped afterwards, so nothing is allocated during the search.
+template<std::size_t N>
+class Beam {
+    unsigned int count = 0;
+
+public:
+    typedef CitySet<N> set_t;
+
+    aligned_vector<cost_t> cost;
+    aligned_vector<cost_t> rest;  // lower bound of the cost to complete the pt
+    std::vector<cid_t> forw;  // current ends of the forward and backward part
+    std::vector<cid_t> back;  // of the tour
+    std::vector<CitySet<N>> S;  // sets of all the nodes visited by the pts
+    std::vector<std::uint64_t> S_hash;  // Zobrist hashes of S
+    std::vector<unsigned int> parent;  // index of the prolonged pt (see Trail)
+
+    Beam(unsigned int capacity) :
+        cost(capacity),
+        rest(capacity),
+        forw(capacity),
+        back(capacity),
+        S(capacity),
+        S_hash(capacity),
+        parent(capacity)
+    {}
+
+    static std::size_t bytes_per_pt()
+    {
+        return 2 * sizeof(cost_t) + 2 * sizeof(cid_t) + sizeof(set_t) +
+            sizeof(std::uint64_t) + sizeof(unsigned int);
+    }
+
+    unsigned int size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    void clear()
+    {
+        count = 0;
+    }
+
+    // append the tour consisting of k only, `k_rest` is its bound
+    void push_root(cid_t k, cost_t k_rest)
+    {
+        forw[count] = k;
+        back[count] = k;
+        S[count] = CitySet<N>();
+        S[count].set(k);
+        S_hash[count] = ZOBRIST[k];
+        cost[count] = 0;
+        rest[count] = k_rest;
+        parent[count] = 0;
+        count++;
+    }
+
+    // Store to slot i pt j of `from` prolonged by city k at the forward (or
+    // backward) end, `pt_cost` being the cost of the whole prolonged pt and
+    // `pt_rest` its bound.
+    void set_prolonged(unsigned int i,
+                       const Beam & from,
+                       unsigned int j,
+                       cid_t k,
+                       cost_t pt_cost,
+                       cost_t pt_rest,
+                       bool forward)
+    {
+        forw[i] = forward ? k : from.forw[j];
+        back[i] = forward ? from.back[j] : k;
+        S[i] = from.S[j];
+        S[i].set(k);
+        // the final step closes the tour in an already visited city
+        S_hash[i] = from.S[j][k] ? from.S_hash[j] : from.S_hash[j] ^ ZOBRIST[k];
+        cost[i] = pt_cost;
+        rest[i] = pt_rest;
+        parent[i] = j;
+    }
+
+    // store to slot i a copy of pt j of `from`
+    void set_copy(unsigned int i, const Beam & from, unsigned int j)
+    {
+        forw[i] = from.forw[j];
+        back[i] = from.back[j];
+        S[i] = from.S[j];
+        S_hash[i] = from.S_hash[j];
+        cost[i] = from.cost[j];
+        rest[i] = from.rest[j];
+        parent[i] = from.parent[j];
+    }
+
+    // take a slot at the end, to be filled by one of the set_* above
+    unsigned int push()
+    {
+        return count++;
+    }
+
+    // what the pts are ranked by in the keepers
+    cost_t rank(unsigned int i) const
+    {
+        return cost[i] + rest[i];
+    }
+};
+
+
+// Cheapest arc into every city over all the days.
+//
+// Every city not visited by a pt yet has to be entered by one of the arcs
+// completing it, so the sum of these over the unvisited cities is a lower
+// bound of the cost of the rest of the tour. It only shrinks by the entry
+// of the added city as a pt is prolonged.
+template<typename costs_t>
+std::vector<cost_t> cheapest_entries(const int n, const Graph<costs_t> & graph)
+{
+    std::vector<cost_t> entry(n, std::numeric_limits<cost_t>::max());
+    for (cid_t day = 0; day < n; day++) {
+        for (cid_t to = 0; to < n; to++) {
+            for (const auto & arc : graph.in_arcs(day, to)) {
+                entry[to] = std::min<cost_t>(entry[to], arc.cost);
+            }
+        }
+    }
+    for (auto & cost : entry) {
+        if (cost == std::numeric_limits<cost_t>::max()) {
+            cost = 0;
+        }
+    }
+    return entry;
 }
 
 
-typedef std::pair<cid_t, std::bitset<MAX_N>> umkey_t;
-
-
-struct PartialTour {
-
-    // The PartialTourPath contains a city index 'k' and a shared pointer
-    // to a PartialTourPath which it prolongs. Unlike std::vector
-    // representation, PartialTourPath copy construction has O(1) complexity.
-    // PartialTourPath is basically an intrusive list linked by shared pointers.
-    struct PartialTourPath {
-      cid_t k;
-      std::shared_ptr<PartialTourPath> prev_ks;
-
-      PartialTourPath(cid_t k, std::shared_ptr<PartialTourPath> ptr = {})
-        : k{k},
-          prev_ks{std::move(ptr)}
-      { }
-
-      std::vector<cid_t> as_vector(bool forward=true, bool reverse=true) const
-      {
-          std::vector<cid_t> tour = forward ?
-              std::vector<cid_t>{k} : std::vector<cid_t>();
-          auto node = prev_ks;
-          while (node) {
-              tour.emplace_back(node->k);
-              node = node->prev_ks;
-          }
-          if (reverse) {
-              std::reverse(tour.begin(), tour.end());
-          }
-          return tour;
-      }
+// Open addressing (linear probing) map from (k, S) pairs to indices of
+// partial tours in Keeper.
+//
+// Slots store a 64-bit fingerprint of the key and the index only; the full
+// key (k and S) is compared with the stored partial tour when the
+// fingerprints match. The slots are allocated for the largest number of
+// partial tours, of which at least twice the current number are used, so
+// probe sequences stay short, nothing is ever rehashed and clearing takes
+// time proportional to the current number only.
+class KSIndex {
+
+    static constexpr unsigned int EMPTY = std::numeric_limits<unsigned int>::max();
+
+    struct Slot {
+        std::uint64_t fp;
+        unsigned int idx;
     };
 
-    std::shared_ptr<PartialTourPath> tour_forw;
-    std::shared_ptr<PartialTourPath> tour_back;
+    std::vector<Slot> slots;
+    std::size_t mask;
 
-    std::bitset<MAX_N> S;  // set of all the nodes visited by this pt
-    cost_t cost;
+    static std::size_t capacity(unsigned int H)
+    {
+        std::size_t capacity = 16;
+        while (capacity < 2 * std::size_t(H)) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
 
-    // index of this pt in the heap in Keeper
-    // (well it feels kind of hackish...)
-    unsigned int heap_idx;
+public:
+    KSIndex(unsigned int H) :
+        slots(capacity(H), Slot{0, EMPTY}),
+        mask(slots.size() - 1)
+    {}
 
-    PartialTour() = default;
-    PartialTour(cid_t k) :
-        tour_forw{std::make_shared<PartialTourPath>(k)},
-        tour_back{std::make_shared<PartialTourPath>(k)},
-        cost(0)
+    // use the slots for H partial tours, only while the index is empty (the
+    // unused slots are always empty)
+    void resize(unsigned int H)
     {
-        S.set(k);
+        mask = std::min(capacity(H), slots.size()) - 1;
     }
 
-    cid_t k_forw() const
+    static std::size_t slot_bytes()
     {
-        return tour_forw->k;
+        return sizeof(Slot);
     }
 
-    cid_t k_back() const
+    static std::uint64_t fingerprint(std::uint64_t S_hash, cid_t k)
     {
-        return tour_back->k;
+        return S_hash ^ ((k + 1) * 0x9e3779b97f4a7c15ull);
     }
 
-    PartialTour prolonged(cid_t idx, cost_t idx_cost, bool forward=true) const
+    // Index of the stored item with fingerprint `fp` for which `same(idx)`
+    // holds, or EMPTY.
+    template<typename Same>
+    unsigned int find(std::uint64_t fp, Same same) const
     {
-        PartialTour pt;
-        if (forward) {
-            pt.tour_forw = std::make_shared<PartialTourPath>(idx, tour_forw);
-            pt.tour_back = tour_back;
-        } else {
-            pt.tour_forw = tour_forw;
-            pt.tour_back = std::make_shared<PartialTourPath>(idx, tour_back);
+        for (std::size_t i = fp & mask; slots[i].idx != EMPTY; i = (i + 1) & mask) {
+            if (slots[i].fp == fp && same(slots[i].idx)) {
+                return slots[i].idx;
+            }
         }
-        pt.S = S;
-        pt.S.set(idx);
-        pt.cost = cost + idx_cost;
-        return pt;
+        return EMPTY;
+    }
+
+    void insert(std::uint64_t fp, unsigned int idx)
+    {
+        std::size_t i = fp & mask;
+        while (slots[i].idx != EMPTY) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = Slot{fp, idx};
+    }
+
+    // remove item `idx` stored with fingerprint `fp` (backward shift
+    // deletion, so that no tombstones are needed)
+    void erase(std::uint64_t fp, unsigned int idx)
+    {
+        std::size_t i = fp & mask;
+        while (slots[i].idx != idx) {
+            i = (i + 1) & mask;
+        }
+        for (std::size_t j = (i + 1) & mask; slots[j].idx != EMPTY; j = (j + 1) & mask) {
+            // can the item in j be moved to the hole in i?
+            const std::size_t home = slots[j].fp & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = Slot{0, EMPTY};
+    }
+
+    void clear()
+    {
+        std::fill(slots.begin(), slots.begin() + mask + 1, Slot{0, EMPTY});
+    }
+
+    static bool missing(unsigned int idx)
+    {
+        return idx == EMPTY;
     }
+};
+
 
+// A prolongation of a partial tour by one city which has not been built yet.
+struct Candidate {
+    unsigned int parent;  // index of the prolonged pt in the previous layer
+    cid_t city;
+    cost_t cost;  // cost of the whole prolonged pt
+    cost_t rank;  // cost plus the bound of the rest of the prolonged pt
 };
 
 
 struct HeapElem {
-    cost_t cost;
+    cost_t cost;  // the rank of the pt
 
-    // index of corresponding PartialTour in partials
+    // index of corresponding pt in partials
     unsigned long int idx;
 };
 
 
+template<std::size_t N>
 struct Keeper {
+
+    typedef Beam<N> beam_t;
+
+    // key of a stored pt, kept aside for full-key comparison and removal
+    struct Key {
+        std::uint64_t fp;
+        cid_t k;
+    };
+
     unsigned int H;
-    std::unordered_map<umkey_t, unsigned int> k_S2idx;
+    KSIndex k_S2idx;
     std::vector<HeapElem> heap;  // max heap ordered by HeapElem.cost
-    std::vector<PartialTour> partials;
+    beam_t partials;
+    std::vector<unsigned int> heap_idx;  // position of partials[i] in heap
+    std::vector<Key> keys;  // keys[i] belongs to partials[i]
 
     /* Structure for keeping H best partial tours (pt).
      *  -> Stored in `partials`.
@@ -135,16 +450,28 @@ struct Keeper {
      * We are only interested in the best pt for each (k, S) pair
      *  -> We maintain the mapping from (k, S) to index in `partials` in
      *  `k_S2idx` so that when a better pt comes, we can place it easily.
+     *  The mapping is keyed by a fingerprint derived from the Zobrist hash of
+     *  S which the pts maintain incrementally.
      */
 
-    Keeper(unsigned int H) : H(H)
+    Keeper(unsigned int H) :
+        H(H),
+        k_S2idx(H),
+        partials(H),
+        heap_idx(H),
+        keys(H)
     {
-        partials.reserve(H);
-        k_S2idx.reserve(MAX_N);
         heap.reserve(H+1);  // 1-indexing for simple child access (i*2, i*2+1)
         heap.push_back(HeapElem{0, 0});
     }
 
+    // the index has up to four slots per pt
+    static std::size_t bytes_per_pt()
+    {
+        return beam_t::bytes_per_pt() + 4 * KSIndex::slot_bytes() +
+            sizeof(HeapElem) + sizeof(unsigned int) + sizeof(Key);
+    }
+
     void heap_print()
     {
         for (auto & elem : heap) {
@@ -166,7 +493,7 @@ struct Keeper {
     bool check()
     {
         for (unsigned int i = 0; i < partials.size(); i++) {
-            if (heap[partials[i].heap_idx].idx != i) {
+            if (heap[heap_idx[i]].idx != i) {
                 return false;
             }
         }
@@ -175,7 +502,7 @@ struct Keeper {
 
     void heap_update_hidx(unsigned int hidx)
     {
-        partials[heap[hidx].idx].heap_idx = hidx;
+        heap_idx[heap[hidx].idx] = hidx;
     }
 
     // swap elements in heap and don't forget to update pointers to them in the
@@ -231,35 +558,79 @@ struct Keeper {
 
     }
 
-    // add one pt to the Keeper if it is good enough
-    void add(PartialTour && pt, cid_t k) {
+    // cost a new pt has to be below of to be kept
+    cost_t threshold() const
+    {
+        return partials.size() < H ? std::numeric_limits<cost_t>::max() : heap[1].cost;
+    }
+
+    // Place a pt with key fingerprint `fp` and rank `pt_cost` if it is good
+    // enough. `same(i)` tells whether partials[i] has the same (k, S) pair,
+    // `write(i)` stores the pt to slot i, which happens only if it is
+    // actually kept.
+    template<typename Same, typename Write>
+    void place(std::uint64_t fp, cid_t k, cost_t pt_cost, Same same, Write write)
+    {
         // is pt with this (k, S) pair stored already?
-        auto key = std::make_pair(k, pt.S);
-        auto it = k_S2idx.find(key);
-        auto pt_cost = pt.cost;
-        if (it != k_S2idx.end()) {
-            PartialTour & found = partials[it->second];
-            if (found.cost > pt_cost) {
-                unsigned int hidx = found.heap_idx;
-                found = std::move(pt);
-                found.heap_idx = hidx;
-                heap_decrease_key(hidx, pt_cost);
+        const unsigned int idx = k_S2idx.find(fp, [&](unsigned int i) {
+            return keys[i].k == k && same(i);
+        });
+        if (!KSIndex::missing(idx)) {
+            // pts with the same (k, S) have the same bound, so comparing
+            // ranks is comparing costs
+            if (heap[heap_idx[idx]].cost > pt_cost) {
+                write(idx);
+                heap_decrease_key(heap_idx[idx], pt_cost);
             }
         // no stored pt has this (k, S) pair
         } else {
             if (partials.size() < H) {
-                partials.emplace_back(std::move(pt));
-                heap_insert(HeapElem{pt_cost, partials.size()-1});
-                k_S2idx[key] = partials.size() - 1;
+                const unsigned int i = partials.push();
+                write(i);
+                keys[i] = Key{fp, k};
+                heap_insert(HeapElem{pt_cost, i});
+                k_S2idx.insert(fp, i);
             } else if (heap[1].cost > pt_cost) {
-                partials[heap[1].idx] = std::move(pt);
-                heap_update_hidx(1);
-                k_S2idx[key] = heap[1].idx;
+                const unsigned int worst = heap[1].idx;
+                k_S2idx.erase(keys[worst].fp, worst);
+                write(worst);
+                keys[worst] = Key{fp, k};
+                k_S2idx.insert(fp, worst);
                 heap_decrease_key(1, pt_cost);
             }
         }
     }
 
+    // add pt c.parent of `parents` prolonged by c.city if it is good enough,
+    // the prolonged pt is built only when it is kept
+    void add(const Candidate & c, const beam_t & parents, bool forward)
+    {
+        const CitySet<N> & S = parents.S[c.parent];
+        const std::uint64_t S_hash = S[c.city] ?
+            parents.S_hash[c.parent] : parents.S_hash[c.parent] ^ ZOBRIST[c.city];
+        place(KSIndex::fingerprint(S_hash, c.city), c.city, c.rank,
+              [&](unsigned int i) {
+                  // is partials.S[i] equal to S with c.city added?
+                  auto diff = partials.S[i] ^ S;
+                  diff.reset(c.city);
+                  return partials.S[i][c.city] && diff.none();
+              },
+              [&](unsigned int i) {
+                  partials.set_prolonged(i, parents, c.parent, c.city, c.cost, c.rank - c.cost, forward);
+              });
+    }
+
+    // change H between layers, up to the H the Keeper was constructed with
+    void resize(unsigned int H_)
+    {
+        H = H_;
+        k_S2idx.resize(H);
+    }
+
+    // pts are placed as they come, so there is nothing to do around layers
+    void begin_layer(const beam_t &) {}
+    void end_layer() {}
+
     void clear()
     {
         k_S2idx.clear();
@@ -269,85 +640,668 @@ struct Keeper {
 };
 
 
-void dp_heuristic(const int n,
-                  const cid_t start,
-                  const costs_table_t & costs,
+template<std::size_t N>
+struct BatchKeeper {
+
+    typedef Beam<N> beam_t;
+
+    struct Entry {
+        std::uint64_t fp;
+        cost_t rank;
+        cost_t cost;
+        unsigned int parent;
+        cid_t city;
+    };
+
+    unsigned int H;
+    cost_t threshold_;
+    bool forward;
+    const beam_t * parents;
+    std::vector<Entry> buffer;
+    beam_t partials;
+
+    /* Alternative to Keeper which selects the H best pts of a layer in bulk.
+     *
+     * All the candidates of a layer are written to the flat `buffer`. At the
+     * end of the layer (or whenever the buffer fills up) the buffer is
+     * sorted by (k, S) fingerprint and rank, only the cheapest candidate of
+     * each (k, S) pair is left, and the best H are selected by nth_element.
+     * Only the selected candidates are then built into `partials`.
+     *
+     * After the first selection the rank of the H-th best candidate is the
+     * threshold for the following ones, like heap[1].cost in Keeper.
+     */
+
+    BatchKeeper(unsigned int H) :
+        H(H),
+        threshold_(std::numeric_limits<cost_t>::max()),
+        forward(true),
+        parents(nullptr),
+        partials(H)
+    {
+        buffer.reserve(4 * std::size_t(H) + 16);
+    }
+
+    static std::size_t bytes_per_pt()
+    {
+        return beam_t::bytes_per_pt() + 4 * sizeof(Entry);
+    }
+
+    cost_t threshold() const
+    {
+        return threshold_;
+    }
+
+    // change H between layers, up to the H the BatchKeeper was constructed with
+    void resize(unsigned int H_)
+    {
+        H = H_;
+    }
+
+    // the pts of the previous layer, which candidates refer to
+    void begin_layer(const beam_t & prev)
+    {
+        parents = &prev;
+    }
+
+    void add(const Candidate & c, const beam_t & parents_, bool forward_)
+    {
+        forward = forward_;
+        const std::uint64_t S_hash = parents_.S[c.parent][c.city] ?
+            parents_.S_hash[c.parent] : parents_.S_hash[c.parent] ^ ZOBRIST[c.city];
+        buffer.push_back(Entry{KSIndex::fingerprint(S_hash, c.city), c.rank, c.cost, c.parent, c.city});
+        if (buffer.size() == buffer.capacity()) {
+            select();
+        }
+    }
+
+    // do the candidates a and b prolong their parents to the same (k, S)?
+    bool same_key(const Entry & a, const Entry & b) const
+    {
+        if (a.city != b.city) {
+            return false;
+        }
+        auto Sa = parents->S[a.parent];
+        auto Sb = parents->S[b.parent];
+        Sa.set(a.city);
+        Sb.set(b.city);
+        return Sa == Sb;
+    }
+
+    // leave only the best H candidates with distinct (k, S) in the buffer
+    void select()
+    {
+        std::sort(buffer.begin(), buffer.end(), [](const Entry & a, const Entry & b) {
+            return a.fp < b.fp || (a.fp == b.fp && a.rank < b.rank);
+        });
+        // runs of equal fingerprints are tiny, keep the first (cheapest)
+        // entry of every distinct key in the run
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < buffer.size(); ) {
+            std::size_t run_end = i + 1;
+            while (run_end < buffer.size() && buffer[run_end].fp == buffer[i].fp) {
+                run_end++;
+            }
+            const std::size_t run_kept = kept;
+            for (std::size_t j = i; j < run_end; ++j) {
+                bool duplicate = false;
+                for (std::size_t r = run_kept; r < kept && !duplicate; ++r) {
+                    duplicate = same_key(buffer[r], buffer[j]);
+                }
+                if (!duplicate) {
+                    buffer[kept++] = buffer[j];
+                }
+            }
+            i = run_end;
+        }
+        buffer.resize(kept);
+
+        if (buffer.size() >= H) {
+            auto by_rank = [](const Entry & a, const Entry & b) { return a.rank < b.rank; };
+            std::nth_element(buffer.begin(), buffer.begin() + (H - 1), buffer.end(), by_rank);
+            buffer.resize(H);
+            threshold_ = buffer[H - 1].rank;
+        }
+    }
+
+    void end_layer()
+    {
+        if (buffer.empty()) {
+            return;
+        }
+        select();
+        for (const auto & e : buffer) {
+            partials.set_prolonged(partials.push(), *parents, e.parent, e.city,
+                                   e.cost, e.rank - e.cost, forward);
+        }
+        buffer.clear();
+    }
+
+    void clear()
+    {
+        threshold_ = std::numeric_limits<cost_t>::max();
+        buffer.clear();
+        partials.clear();
+    }
+};
+
+
+// Chooses the beam width H for every layer so that the search finishes
+// around `deadline`.
+//
+// The time of a layer is about proportional to the number of pts it
+// expands. The time per expanded pt is measured on the finished layers
+// (exponentially averaged) and H is set so that the remaining layers fit
+// into the remaining time. H never exceeds H_max, which all the memory is
+// allocated for, and at most doubles between layers, as the first layers
+// are too small to measure reliably. Once TERMINATE is set, the remaining
+// layers are done greedily.
+class BeamController {
+    unsigned int H;
+    unsigned int H_max;
+    std::chrono::steady_clock::time_point deadline;
+    double per_pt = 0;  // seconds
+
+public:
+    BeamController(unsigned int H,
+                   unsigned int H_max,
+                   std::chrono::steady_clock::time_point deadline) :
+        H(std::min(H, H_max)),
+        H_max(H_max),
+        deadline(deadline)
+    {}
+
+    unsigned int width() const
+    {
+        return H;
+    }
+
+    // a layer which expanded `expanded` pts took `seconds`, `layers_left`
+    // layers remain
+    void update(std::size_t expanded, double seconds, unsigned int layers_left)
+    {
+        if (expanded > 0) {
+            const double sample = seconds / expanded;
+            per_pt = per_pt == 0 ? sample : 0.7 * per_pt + 0.3 * sample;
+        }
+        const double left = std::chrono::duration<double>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0 || TERMINATE.load()) {
+            H = 1;
+        } else if (layers_left > 0 && per_pt > 0) {
+            const double target = left / (layers_left * per_pt);
+            const double cap = std::min<double>(H_max, 2.0 * H);
+            H = std::max(1u, static_cast<unsigned int>(std::min(target, cap)));
+        }
+    }
+};
+
+
+// Merge the pts kept by the shards into `beam`, keep only the best H.
+// The shards never share a (k, S) pair, as they are split by k.
+//
+// With a single shard its pts are swapped into `beam`, otherwise the best H
+// are selected by rank in `order` (preallocated by the caller) and only those
+// are copied.
+template<typename keeper_t>
+void merge_shards(std::vector<keeper_t> & shards,
                   unsigned int H,
-                  std::chrono::steady_clock::time_point end_time,
-                  const std::vector<int> & directions,
-                  std::vector<cid_t> & best_tour)
+                  typename keeper_t::beam_t & beam,
+                  std::vector<HeapElem> & order)
 {
-    std::size_t f_steps{};
-    std::size_t b_steps{};
-    Keeper keeper(H);
-    keeper.add(PartialTour(start), start);
-    Keeper new_keeper(H);
-
-    for (cid_t t = 0; t < n-1; t++) {
-        if (directions[t] == FORWARD) {
-            for (const auto & pt : keeper.partials) {
-                for (cid_t to = 0; to < n; to++) {
-                    cost_t cost = costs[f_steps][pt.k_forw()][to];
-                    if (!pt.S[to] && cost >= 0) {
-                        new_keeper.add(pt.prolonged(to, cost), to);
+    beam.clear();
+    if (shards.size() == 1) {
+        std::swap(beam, shards[0].partials);
+        shards[0].clear();
+        return;
+    }
+    order.clear();
+    for (unsigned int w = 0; w < shards.size(); w++) {
+        const auto & partials = shards[w].partials;
+        for (unsigned int i = 0; i < partials.size(); i++) {
+            // the shard goes to the high bits of the index
+            order.push_back(HeapElem{partials.rank(i), (std::size_t(w) << 32) | i});
+        }
+    }
+    if (order.size() > H) {
+        std::nth_element(
+            order.begin(),
+            order.begin() + (H - 1),
+            order.end(),
+            [](const HeapElem & a, const HeapElem & b) { return a.cost < b.cost; }
+        );
+        order.resize(H);
+    }
+    for (const auto & elem : order) {
+        beam.set_copy(beam.push(), shards[elem.idx >> 32].partials, elem.idx & 0xffffffff);
+    }
+    for (auto & shard : shards) {
+        shard.clear();
+    }
+}
+
+
+// Beam search over the partial tours (pts) grown from `start`, each step
+// prolonging them by one city at the forward or backward end.
+//
+// With `bound` the pts are ranked by their cost plus the lower bound of the
+// cost of the rest of the tour (see cheapest_entries), so that pts which took
+// cheap arcs early but have expensive cities left do not crowd out the
+// others. Otherwise the bound is 0 and the pts are ranked by their cost.
+//
+// Every layer is expanded by `threads` tasks on `pool`. Task w owns the shard
+// keeping the candidates whose new city falls into its range of cities, so
+// the shards can be filled without any locking and merged at the end of the
+// layer.
+template<typename keeper_t, typename costs_t>
+class BeamSearch {
+public:
+    typedef typename keeper_t::beam_t beam_t;
+
+private:
+    const int n;
+    const cid_t start;
+    const Graph<costs_t> & graph;
+    ThreadPool & pool;
+    const unsigned int threads;
+    std::vector<cost_t> entry;
+    cost_t max_entry;
+    std::vector<keeper_t> shards;
+    std::vector<HeapElem> order;  // for merge_shards
+    expand_fn<typename costs_t::value_type> expand;
+    std::vector<std::vector<Successor>> successors;  // of the dense kernels
+    std::vector<unsigned int> ranked;  // for publish, kept between layers
+    std::vector<cid_t> completed;  // for publish, kept between layers
+
+public:
+    beam_t beam;  // the last layer
+    Trail trail;
+    cid_t layers = 0;
+    std::size_t f_steps = 0;
+    std::size_t b_steps = 0;
+
+    BeamSearch(const int n,
+               const cid_t start,
+               const Graph<costs_t> & graph,
+               unsigned int H_max,
+               ThreadPool & pool,
+               unsigned int threads,
+               bool bound) :
+        n(n),
+        start(start),
+        graph(graph),
+        pool(pool),
+        threads(threads),
+        entry(bound ? cheapest_entries(n, graph) : std::vector<cost_t>(n, 0)),
+        max_entry(*std::max_element(entry.begin(), entry.end())),
+        shards(threads, keeper_t(H_max)),
+        expand(expand_kernel<typename costs_t::value_type>()),
+        successors(threads, std::vector<Successor>(n)),
+        beam(H_max),
+        trail(n, H_max)
+    {
+        order.reserve(std::size_t(threads) * H_max);
+        beam.push_root(start, std::accumulate(entry.begin(), entry.end(), cost_t(0)) - entry[start]);
+    }
+
+    // Memory taken per pt of H_max: a trail node per layer, the beam, and a
+    // keeper and a place in `order` per thread.
+    static std::size_t bytes_per_pt(int n, unsigned int threads)
+    {
+        return Trail::bytes_per_pt(n) + beam_t::bytes_per_pt() +
+            threads * (keeper_t::bytes_per_pt() + sizeof(HeapElem));
+    }
+
+    // prolong the pts at the forward (or backward) end, keep the best H
+    void step(unsigned int H, bool forward)
+    {
+        for (auto & shard : shards) {
+            shard.resize(H);
+        }
+        pool.parallel_for(threads, [this, forward](unsigned int w) {
+            keeper_t & keeper = shards[w];
+            const cid_t lo = w * n / threads;
+            const cid_t hi = (w + 1) * n / threads;
+            keeper.begin_layer(beam);
+            for (unsigned int i = 0; i < beam.size(); i++) {
+                const cost_t pt_cost = beam.cost[i];
+                const cost_t pt_rest = beam.rest[i];
+                const auto & S = beam.S[i];
+                if (graph.dense) {
+                    const auto * row = forward ?
+                        graph.costs.row(f_steps, beam.forw[i]) :
+                        graph.costs_T.row(n-b_steps-1, beam.back[i]);
+                    // the kernel filters by the arc cost only, assume the
+                    // largest entry is subtracted from the bound
+                    const cost_t threshold = keeper.threshold();
+                    const cost_t limit = threshold == std::numeric_limits<cost_t>::max() ?
+                        threshold : threshold - (pt_cost + pt_rest - max_entry) - 1;
+                    if (limit < 0) {
+                        continue;
+                    }
+                    Successor * succ = successors[w].data();
+                    const std::size_t found = expand(row, S.words(), lo, hi, pt_cost, limit, succ);
+                    for (std::size_t j = 0; j < found; j++) {
+                        const cost_t rank = succ[j].cost + pt_rest - entry[succ[j].city];
+                        if (rank < keeper.threshold()) {
+                            keeper.add(Candidate{i, succ[j].city, succ[j].cost, rank}, beam, forward);
+                        }
                     }
+                    continue;
                 }
-            }
-            f_steps++;
-        } else {
-            for (const auto & pt : keeper.partials) {
-                for (cid_t to = 0; to < n; to++) {
-                    cost_t cost = costs[n-b_steps-1][to][pt.k_back()];
-                    if (!pt.S[to] && cost >= 0) {
-                        new_keeper.add(pt.prolonged(to, cost, false), to);
+                const auto arcs = forward ?
+                    graph.out_arcs(f_steps, beam.forw[i]) :
+                    graph.in_arcs(n-b_steps-1, beam.back[i]);
+                // arcs are sorted by city, skip to the range of this shard
+                const auto * arc = lo == 0 ? arcs.begin() : std::lower_bound(
+                    arcs.begin(), arcs.end(), lo,
+                    [](const Arc<typename costs_t::value_type> & a, cid_t city) {
+                        return a.city < city;
+                    });
+                for (; arc != arcs.end() && arc->city < hi; ++arc) {
+                    const cost_t cost = pt_cost + arc->cost;
+                    const cost_t rank = cost + pt_rest - entry[arc->city];
+                    if (!S[arc->city] && rank < keeper.threshold()) {
+                        keeper.add(Candidate{i, arc->city, cost, rank}, beam, forward);
                     }
                 }
             }
+            keeper.end_layer();
+        });
+        if (forward) {
+            f_steps++;
+        } else {
             b_steps++;
         }
+        merge_shards(shards, H, beam, order);
+        trail.record(++layers, beam, forward);
+    }
+
+    // Close the tours after all the cities are visited, by the last step in
+    // the forward (or backward) direction. The closing arc is the one left
+    // between the forward and backward ends.
+    void close(bool forward)
+    {
+        // one candidate per pt, so a single shard is enough
+        keeper_t & keeper = shards[0];
+        keeper.begin_layer(beam);
+        for (unsigned int i = 0; i < beam.size(); i++) {
+            cid_t to;
+            cost_t cost;
+            if (forward) {
+                to = beam.back[i];
+                cost = graph.costs(f_steps, beam.forw[i], to);
+            } else {
+                to = beam.forw[i];
+                cost = graph.costs(n-b_steps-1, to, beam.back[i]);
+            }
+            // all the cities are visited, so the bound is 0
+            if (cost >= 0) {
+                keeper.add(Candidate{i, to, beam.cost[i] + cost, beam.cost[i] + cost},
+                           beam, forward);
+            }
+        }
+        keeper.end_layer();
+        std::swap(beam, keeper.partials);
         keeper.clear();
-        std::swap(keeper, new_keeper);
+    }
 
-        // if we are running out of time, hurry up
-        auto time_remaining = end_time - std::chrono::steady_clock::now();
-        if (time_remaining < std::chrono::milliseconds(100)) {
-            H = 1;
-            new_keeper = Keeper(H);
-        } else if (time_remaining < std::chrono::milliseconds(500)) {
-            H = 50;
-            new_keeper = Keeper(H);
-        } else if (time_remaining < std::chrono::milliseconds(1000)) {
-            H = 200;
-            new_keeper = Keeper(H);
+    // Extend `middle` from `city` on `day` to visit all the cities not in S
+    // and end with an arc to `last` on the closing day, trying the cheapest
+    // arcs first and backtracking over at most `budget` arcs overall.
+    bool extend(std::size_t day,
+                cid_t city,
+                cid_t last,
+                typename beam_t::set_t & S,
+                std::vector<cid_t> & middle,
+                std::size_t & budget) const
+    {
+        if (day == n-b_steps-1) {
+            return graph.costs(day, city, last) != NO_ARC;
         }
+        std::vector<Arc<typename costs_t::value_type>> next;
+        for (const auto & arc : graph.out_arcs(day, city)) {
+            if (!S[arc.city]) {
+                next.push_back(arc);
+            }
+        }
+        std::sort(next.begin(), next.end(), [](const Arc<typename costs_t::value_type> & a,
+                                               const Arc<typename costs_t::value_type> & b) {
+            return a.cost < b.cost;
+        });
+        for (const auto & arc : next) {
+            if (budget == 0) {
+                return false;
+            }
+            budget--;
+            S.set(arc.city);
+            middle.push_back(arc.city);
+            if (extend(day+1, arc.city, last, S, middle, budget)) {
+                return true;
+            }
+            S.reset(arc.city);
+            middle.pop_back();
+        }
+        return false;
     }
-    for (const auto & pt : keeper.partials) {
-        cid_t to;
-        cost_t cost;
-        if (directions[n-1] == FORWARD) {
-            to = pt.k_back();
-            cost = costs[f_steps][pt.k_forw()][to];
-        } else {
-            to = pt.k_forw();
-            cost = costs[n-b_steps-1][to][pt.k_back()];
+
+    // Complete pt i greedily into `tour`: from the forward end take the
+    // cheapest arcs to unvisited cities and close the tour to the backward
+    // end, backtracking a little when that gets stuck. Returns the cost of
+    // the tour, NO_ARC if no completion was found.
+    cost_t complete_greedily(unsigned int i,
+                             const std::vector<int> & directions,
+                             std::vector<cid_t> & tour) const
+    {
+        std::vector<cid_t> middle;
+        auto S = beam.S[i];
+        std::size_t budget = 4 * std::size_t(n);
+        if (!extend(f_steps, beam.forw[i], beam.back[i], S, middle, budget)) {
+            return NO_ARC;
         }
-        if (cost >= 0) {
-            new_keeper.add(pt.prolonged(to, cost, directions[n-1] == FORWARD), to);
+        // start, the forward part, the middle, the backward part, start
+        trail.tour(start, layers, i, directions, tour);
+        tour.insert(tour.begin() + f_steps + 1, middle.begin(), middle.end());
+        cost_t cost = 0;
+        for (std::size_t t = 0; t < f_steps + middle.size() + b_steps + 1; t++) {
+            cost += graph.costs(t, tour[t], tour[t+1]);
         }
+        return cost;
     }
-    std::swap(keeper, new_keeper);
 
-    if (keeper.partials.empty()) {
-        return;
+    // Offer the greedy completion of the best ranked pt to `incumbent`. On
+    // sparse graphs greedy often gets stuck, so up to `tries` pts are tried
+    // in the order of their rank.
+    void publish(Incumbent & incumbent,
+                 const std::vector<int> & directions,
+                 unsigned int tries = 8)
+    {
+        ranked.resize(beam.size());
+        std::iota(ranked.begin(), ranked.end(), 0);
+        tries = std::min<unsigned int>(tries, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + tries, ranked.end(),
+                          [this](unsigned int a, unsigned int b) {
+                              return beam.rank(a) < beam.rank(b);
+                          });
+        for (unsigned int i = 0; i < tries; i++) {
+            const cost_t cost = complete_greedily(ranked[i], directions, completed);
+            if (cost != NO_ARC) {
+                incumbent.offer(completed, cost);
+                return;
+            }
+        }
     }
 
-    // there can be only one partial tour for S = {0 .. n-1}, k = start
-    auto bt_forw = keeper.partials[0].tour_forw->as_vector();
-    auto bt_back = keeper.partials[0].tour_back->as_vector(false,false);
+    // The cheapest of the tours after close(), there is one per closing city
+    // k. Empty if no tour could be closed.
+    std::vector<cid_t> cheapest(const std::vector<int> & directions) const
+    {
+        if (beam.empty()) {
+            return std::vector<cid_t>();
+        }
+        const auto best = std::min_element(beam.cost.begin(), beam.cost.begin() + beam.size());
+        return trail.tour(start, layers, beam.parent[best - beam.cost.begin()], directions);
+    }
+};
+
+
+// Grow `search` by `layers` steps in the given directions (starting at
+// directions[search.layers]), adapting the beam width so that it finishes
+// around `end_time`. After every step the greedy completion of the best pt
+// is offered to `incumbent`, so that there is a tour long before the search
+// ends. The time of the offer is part of the time of the step the beam width
+// is adapted to.
+template<typename search_t>
+void grow(search_t & search,
+          cid_t layers,
+          unsigned int H,
+          unsigned int H_max,
+          std::chrono::steady_clock::time_point end_time,
+          const std::vector<int> & directions,
+          Incumbent * incumbent)
+{
+    BeamController beam_width(H, H_max, end_time);
+    for (cid_t t = 0; t < layers; t++) {
+        const auto layer_start = std::chrono::steady_clock::now();
+        const std::size_t expanded = search.beam.size();
+        search.step(beam_width.width(), directions[search.layers] == FORWARD);
+        if (incumbent) {
+            search.publish(*incumbent, directions);
+        }
+        // publishing ranks the whole beam, so it counts into the layer time
+        beam_width.update(
+            expanded,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - layer_start).count(),
+            layers-1-t
+        );
+    }
+}
+
+
+// Beam search over the whole tour, each step going forward or backward
+// according to `directions`.
+template<typename keeper_t, typename costs_t>
+void dp_heuristic(const int n,
+                  const cid_t start,
+                  const Graph<costs_t> & graph,
+                  unsigned int H,
+                  unsigned int H_max,
+                  std::chrono::steady_clock::time_point end_time,
+                  const std::vector<int> & directions,
+                  std::vector<cid_t> & best_tour,
+                  ThreadPool & pool,
+                  unsigned int threads = 1,
+                  bool bound = false,
+                  Incumbent * incumbent = nullptr)
+{
+    BeamSearch<keeper_t, costs_t> search(n, start, graph, H_max, pool, threads, bound);
+    grow(search, n-1, H, H_max, end_time, directions, incumbent);
+    search.close(directions[n-1] == FORWARD);
+    auto tour = search.cheapest(directions);
+    if (!tour.empty()) {
+        best_tour = std::move(tour);
+    }
+}
+
+
+// Meet in the middle: a forward beam search over the days [0, m) and a
+// backward one over the days (m, n) are grown in parallel, each with its own
+// `threads` tasks per layer, and their pts are joined by the arcs of day m.
+//
+// A forward pt start -> a and a backward pt b -> start join into a tour if
+// their visited sets share just `start` and cover all the cities, and there
+// is an arc from a to b on day m. The forward pts are sorted by the hash of
+// their visited sets, so the matches of every backward pt are found by
+// looking up the hash of the complement of its set.
+//
+// The halves get half of the time. Unless the beams hold a good part of all
+// the visited sets (small n), they may hold no complementary pair. The
+// forward half then goes on alone over the rest of the days instead.
+template<typename keeper_t, typename costs_t>
+void dp_meet_in_middle(const int n,
+                       const cid_t start,
+                       const Graph<costs_t> & graph,
+                       unsigned int H,
+                       unsigned int H_max,
+                       std::chrono::steady_clock::time_point end_time,
+                       const cid_t m,
+                       std::vector<cid_t> & best_tour,
+                       ThreadPool & pool,
+                       unsigned int threads = 1,
+                       bool bound = false,
+                       Incumbent * incumbent = nullptr)
+{
+    typedef BeamSearch<keeper_t, costs_t> search_t;
+    const std::vector<int> forw_dirs(n, FORWARD);
+    const std::vector<int> back_dirs(n, BACKWARD);
+    search_t forw(n, start, graph, H_max, pool, threads, bound);
+    search_t back(n, start, graph, H_max, pool, threads, bound);
+
+    const auto now = std::chrono::steady_clock::now();
+    const auto halves_end_time = now + (end_time - now) / 2;
+    pool.parallel_for(2, [&](unsigned int half) {
+        if (half == 0) {
+            grow(forw, m, H, H_max, halves_end_time, forw_dirs, incumbent);
+        } else {
+            grow(back, n-1-m, H, H_max, halves_end_time, back_dirs, incumbent);
+        }
+    });
 
-    best_tour = bt_forw;
-    best_tour.insert(best_tour.end(), bt_back.begin(), bt_back.end());
+    typename search_t::beam_t::set_t all;
+    std::uint64_t all_hash = 0;
+    for (cid_t city = 0; city < n; city++) {
+        all.set(city);
+        all_hash ^= ZOBRIST[city];
+    }
+
+    // (hash of the visited set, index) of the forward pts
+    std::vector<std::pair<std::uint64_t, unsigned int>> by_hash(forw.beam.size());
+    for (unsigned int i = 0; i < forw.beam.size(); i++) {
+        by_hash[i] = std::make_pair(forw.beam.S_hash[i], i);
+    }
+    std::sort(by_hash.begin(), by_hash.end());
+
+    cost_t best_cost = std::numeric_limits<cost_t>::max();
+    unsigned int best_forw = 0;
+    unsigned int best_back = 0;
+    for (unsigned int j = 0; j < back.beam.size(); j++) {
+        // the start is in both sets
+        const std::uint64_t wanted = all_hash ^ back.beam.S_hash[j] ^ ZOBRIST[start];
+        auto match = std::lower_bound(by_hash.begin(), by_hash.end(), std::make_pair(wanted, 0u));
+        for (; match != by_hash.end() && match->first == wanted; ++match) {
+            const unsigned int i = match->second;
+            const cost_t arc = graph.costs(m, forw.beam.forw[i], back.beam.back[j]);
+            if (arc == NO_ARC) {
+                continue;
+            }
+            const cost_t cost = forw.beam.cost[i] + arc + back.beam.cost[j];
+            if (cost >= best_cost) {
+                continue;
+            }
+            auto S = forw.beam.S[i] ^ back.beam.S[j];
+            S.set(start);
+            if (S == all) {
+                best_cost = cost;
+                best_forw = i;
+                best_back = j;
+            }
+        }
+    }
+    if (best_cost == std::numeric_limits<cost_t>::max()) {
+        grow(forw, n-1-m, H, H_max, end_time, forw_dirs, incumbent);
+        forw.close(true);
+        auto tour = forw.cheapest(forw_dirs);
+        if (!tour.empty()) {
+            best_tour = std::move(tour);
+        }
+        return;
+    }
 
+    // start ... a from the forward pt, b ... start from the backward one
+    best_tour = forw.trail.tour(start, m, best_forw, forw_dirs);
+    best_tour.pop_back();
+    const auto suffix = back.trail.tour(start, n-1-m, best_back, back_dirs);
+    best_tour.insert(best_tour.end(), suffix.begin() + 1, suffix.end());
 }
 
 #endif
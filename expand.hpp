@@ -0,0 +1,220 @@
+#ifndef EXPAND_HPP_
+#define EXPAND_HPP_
+
+#include<cstdint>
+#include<limits>
+
+#include "common.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define EXPAND_X86
+#endif
+
+
+// A prolongation found by an expansion kernel: the new city and the cost of
+// the whole prolonged partial tour.
+struct Successor {
+    cid_t city;
+    cost_t cost;
+};
+
+
+/* Expansion kernels
+ *
+ * A kernel scans the cities [lo, hi) of one padded row of a CostTable (the
+ * arcs from or to the end of a partial tour) and writes to `out` every city
+ * which
+ *  - has an arc (is not NO_ARC),
+ *  - is not in `visited` (the words of the visited set),
+ *  - and whose arc costs at most `limit`, so that the prolonged partial tour
+ *    can still beat the admission threshold of the keeper.
+ * The costs written are `base` plus the cost of the arc. The number of
+ * successors written is returned, `out` has to have room for hi-lo of them.
+ *
+ * The vectorized kernels test a whole block of cities per instruction and
+ * rely on the row being aligned and padded with NO_ARC to 64 bytes.
+ */
+template<typename T>
+using expand_fn = std::size_t (*)(const T * row,
+                                  const std::uint64_t * visited,
+                                  cid_t lo,
+                                  cid_t hi,
+                                  cost_t base,
+                                  cost_t limit,
+                                  Successor * out);
+
+
+template<typename T>
+std::size_t expand_scalar(const T * row,
+                          const std::uint64_t * visited,
+                          cid_t lo,
+                          cid_t hi,
+                          cost_t base,
+                          cost_t limit,
+                          Successor * out)
+{
+    std::size_t count = 0;
+    for (cid_t to = lo; to < hi; ++to) {
+        const cost_t cost = row[to];
+        if (cost != NO_ARC && cost <= limit && !((visited[to / 64] >> (to % 64)) & 1)) {
+            out[count++] = Successor{to, base + cost};
+        }
+    }
+    return count;
+}
+
+
+#ifdef EXPAND_X86
+
+// Bits of the lanes of block [b, b+L) which are unvisited and in [lo, hi).
+// L divides 64, so a block never spans two words of the visited set.
+template<unsigned int L>
+inline std::uint32_t block_mask(const std::uint64_t * visited, cid_t b, cid_t lo, cid_t hi)
+{
+    std::uint32_t mask = static_cast<std::uint32_t>(~visited[b / 64] >> (b % 64)) & ((1u << L) - 1);
+    if (b < lo) {
+        mask &= ~((1u << (lo - b)) - 1);
+    }
+    if (b + L > hi) {
+        mask &= (1u << (hi - b)) - 1;
+    }
+    return mask;
+}
+
+template<typename T>
+inline T clamp_limit(cost_t limit)
+{
+    return static_cast<T>(std::min<cost_t>(limit, std::numeric_limits<T>::max()));
+}
+
+template<typename T>
+inline std::size_t emit(std::uint32_t mask,
+                        const T * row,
+                        cid_t b,
+                        cost_t base,
+                        Successor * out)
+{
+    std::size_t count = 0;
+    while (mask) {
+        const cid_t to = b + __builtin_ctz(mask);
+        mask &= mask - 1;
+        out[count++] = Successor{to, base + row[to]};
+    }
+    return count;
+}
+
+
+__attribute__((target("sse2")))
+inline std::size_t expand_sse2(const int16_t * row,
+                               const std::uint64_t * visited,
+                               cid_t lo,
+                               cid_t hi,
+                               cost_t base,
+                               cost_t limit,
+                               Successor * out)
+{
+    const __m128i no_arc = _mm_set1_epi16(NO_ARC);
+    const __m128i lim = _mm_set1_epi16(clamp_limit<int16_t>(limit));
+    std::size_t count = 0;
+    for (cid_t b = lo & ~7; b < hi; b += 8) {
+        const __m128i c = _mm_load_si128(reinterpret_cast<const __m128i *>(row + b));
+        const __m128i ok = _mm_andnot_si128(_mm_cmpgt_epi16(c, lim), _mm_cmpgt_epi16(c, no_arc));
+        // one byte per lane
+        std::uint32_t mask = _mm_movemask_epi8(_mm_packs_epi16(ok, _mm_setzero_si128()));
+        mask &= block_mask<8>(visited, b, lo, hi);
+        count += emit(mask, row, b, base, out + count);
+    }
+    return count;
+}
+
+__attribute__((target("sse2")))
+inline std::size_t expand_sse2(const int32_t * row,
+                               const std::uint64_t * visited,
+                               cid_t lo,
+                               cid_t hi,
+                               cost_t base,
+                               cost_t limit,
+                               Successor * out)
+{
+    const __m128i no_arc = _mm_set1_epi32(NO_ARC);
+    const __m128i lim = _mm_set1_epi32(clamp_limit<int32_t>(limit));
+    std::size_t count = 0;
+    for (cid_t b = lo & ~3; b < hi; b += 4) {
+        const __m128i c = _mm_load_si128(reinterpret_cast<const __m128i *>(row + b));
+        const __m128i ok = _mm_andnot_si128(_mm_cmpgt_epi32(c, lim), _mm_cmpgt_epi32(c, no_arc));
+        std::uint32_t mask = _mm_movemask_ps(_mm_castsi128_ps(ok));
+        mask &= block_mask<4>(visited, b, lo, hi);
+        count += emit(mask, row, b, base, out + count);
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline std::size_t expand_avx2(const int16_t * row,
+                               const std::uint64_t * visited,
+                               cid_t lo,
+                               cid_t hi,
+                               cost_t base,
+                               cost_t limit,
+                               Successor * out)
+{
+    const __m256i no_arc = _mm256_set1_epi16(NO_ARC);
+    const __m256i lim = _mm256_set1_epi16(clamp_limit<int16_t>(limit));
+    std::size_t count = 0;
+    for (cid_t b = lo & ~15; b < hi; b += 16) {
+        const __m256i c = _mm256_load_si256(reinterpret_cast<const __m256i *>(row + b));
+        const __m256i ok = _mm256_andnot_si256(_mm256_cmpgt_epi16(c, lim), _mm256_cmpgt_epi16(c, no_arc));
+        // one byte per lane: packs works within the 128-bit halves, so move
+        // the low quadwords of both halves next to each other
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(ok, ok), 0x08);
+        std::uint32_t mask = _mm256_movemask_epi8(packed) & 0xffff;
+        mask &= block_mask<16>(visited, b, lo, hi);
+        count += emit(mask, row, b, base, out + count);
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline std::size_t expand_avx2(const int32_t * row,
+                               const std::uint64_t * visited,
+                               cid_t lo,
+                               cid_t hi,
+                               cost_t base,
+                               cost_t limit,
+                               Successor * out)
+{
+    const __m256i no_arc = _mm256_set1_epi32(NO_ARC);
+    const __m256i lim = _mm256_set1_epi32(clamp_limit<int32_t>(limit));
+    std::size_t count = 0;
+    for (cid_t b = lo & ~7; b < hi; b += 8) {
+        const __m256i c = _mm256_load_si256(reinterpret_cast<const __m256i *>(row + b));
+        const __m256i ok = _mm256_andnot_si256(_mm256_cmpgt_epi32(c, lim), _mm256_cmpgt_epi32(c, no_arc));
+        std::uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+        mask &= block_mask<8>(visited, b, lo, hi);
+        count += emit(mask, row, b, base, out + count);
+    }
+    return count;
+}
+
+#endif
+
+
+// the best kernel the CPU we are running on supports
+template<typename T>
+expand_fn<T> expand_kernel()
+{
+#ifdef EXPAND_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return static_cast<expand_fn<T>>(expand_avx2);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return static_cast<expand_fn<T>>(expand_sse2);
+    }
+#endif
+    return expand_scalar<T>;
+}
+
+#endif
+// vim: set tabstop=4 expandtab shiftwidth=4 softtabstop=4 shiftround
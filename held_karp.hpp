@@ -0,0 +1,243 @@
+#ifndef HELD_KARP_HPP_
+#define HELD_KARP_HPP_
+
+#include<vector>
+#include<limits>
+#include<chrono>
+#include<cstdint>
+
+#include "common.hpp"
+#include "thread_pool.hpp"
+
+// up to n = 23 with 32-bit values, solved in about 2 s on one core
+constexpr std::size_t HELD_KARP_BYTES{std::size_t(512) << 20};  // of the DP table
+constexpr unsigned int HELD_KARP_CHUNKS{4};  // tasks of a layer per worker
+
+
+/* Exact time-dependent Held-Karp
+ *
+ * The m = n-1 cities other than start are numbered 0..m-1 and a set of them
+ * is a bit mask. dp[S * m + j] is the cost of the cheapest path leaving start
+ * on day 0 through exactly the cities in S and ending at j in S, so its last
+ * arc is flown on the day |S|-1:
+ *   dp[{j}][j] = costs(0, start, j)
+ *   dp[S][j]   = min over i in S-{j} of dp[S-{j}][i] + costs(|S|-1, i, j)
+ * and the best tour closes with costs(n-1, j, start) from dp[all][j].
+ *
+ * The masks are processed by layers of equal popcount, since a layer only
+ * reads the previous one, all its masks are independent and the layer is
+ * split among the workers of the pool. A chunk of a layer starts at the mask
+ * of its rank among the masks of the layer in increasing order (the
+ * combinatorial number system) and steps to the next larger mask with the
+ * same popcount (Gosper's hack), so no other masks are visited.
+ *
+ * The tables hold values of the narrowest type which can hold the cost of
+ * any tour, with every arc of a day copied into a dense m x m block so that
+ * the inner loop reads memory close together.
+ */
+
+
+// bytes of the dp table for n cities with values of `width` bytes
+std::size_t held_karp_bytes(std::size_t n, std::size_t width)
+{
+    if (n < 2 || n - 1 >= 8 * sizeof(std::size_t) - 6) {
+        return std::numeric_limits<std::size_t>::max();
+    }
+    const std::size_t m = n - 1;
+    return (std::size_t(1) << m) * m * width;
+}
+
+
+// the next larger mask with the same number of bits set
+inline std::size_t next_combination(std::size_t S)
+{
+    const std::size_t lowest = S & -S;
+    const std::size_t ripple = S + lowest;
+    return ripple | (((S ^ ripple) >> 2) / lowest);
+}
+
+
+// The mask of rank r among the masks of m bits with k of them set, in
+// increasing order. binom[i][j] is i choose j.
+std::size_t unrank_combination(std::size_t r,
+                               std::size_t m,
+                               std::size_t k,
+                               const std::vector<std::vector<std::size_t>> & binom)
+{
+    std::size_t S = 0;
+    for (std::size_t bit = m; bit-- > 0 && k > 0; ) {
+        if (binom[bit][k] <= r) {
+            S |= std::size_t(1) << bit;
+            r -= binom[bit][k];
+            k--;
+        }
+    }
+    return S;
+}
+
+
+// The cost of an optimal tour into `tour`, the maximal cost_t if there is
+// no tour. Gives up and returns -1 if a layer would start after `deadline`
+// or once TERMINATE is set.
+template<typename value_t, typename costs_t>
+cost_t held_karp_tables(const std::size_t n,
+                        const cid_t start,
+                        const costs_t & costs,
+                        ThreadPool & pool,
+                        std::chrono::steady_clock::time_point deadline,
+                        std::vector<cid_t> & tour)
+{
+    // twice INF still fits into value_t, so that sums need no checks
+    constexpr value_t INF = std::numeric_limits<value_t>::max() / 2;
+    const std::size_t m = n - 1;
+    const std::size_t full = (std::size_t(1) << m) - 1;
+
+    std::vector<cid_t> cities;
+    for (cid_t city = 0; city < n; ++city) {
+        if (city != start) {
+            cities.push_back(city);
+        }
+    }
+
+    // arc[(day * m + i) * m + j]: the cost from the i-th to the j-th city
+    std::vector<value_t> arc(n * m * m, INF);
+    for (std::size_t day = 1; day + 1 < n; ++day) {
+        for (std::size_t i = 0; i < m; ++i) {
+            const auto * row = costs.row(day, cities[i]);
+            for (std::size_t j = 0; j < m; ++j) {
+                if (row[cities[j]] != NO_ARC) {
+                    arc[(day * m + i) * m + j] = row[cities[j]];
+                }
+            }
+        }
+    }
+
+    // entries of j not in S are never read
+    std::vector<value_t> dp((full + 1) * m);
+    for (std::size_t j = 0; j < m; ++j) {
+        const cost_t cost = costs(0, start, cities[j]);
+        dp[(std::size_t(1) << j) * m + j] = cost == NO_ARC ? INF : value_t(cost);
+    }
+
+    std::vector<std::vector<std::size_t>> binom(m + 1, std::vector<std::size_t>(m + 1, 0));
+    for (std::size_t i = 0; i <= m; ++i) {
+        binom[i][0] = 1;
+        for (std::size_t j = 1; j <= i; ++j) {
+            binom[i][j] = binom[i-1][j-1] + (j < i ? binom[i-1][j] : 0);
+        }
+    }
+
+    const unsigned int chunks = pool.size() * HELD_KARP_CHUNKS;
+    for (std::size_t layer = 2; layer <= m; ++layer) {
+        if (TERMINATE.load() || std::chrono::steady_clock::now() > deadline) {
+            return -1;
+        }
+        const value_t * day_arcs = &arc[(layer - 1) * m * m];
+        const std::size_t masks = binom[m][layer];
+        pool.parallel_for(chunks, [&](unsigned int c) {
+            const std::size_t lo = c * masks / chunks;
+            const std::size_t hi = (c + 1) * masks / chunks;
+            if (lo == hi) {
+                return;
+            }
+            std::size_t S = unrank_combination(lo, m, layer, binom);
+            for (std::size_t r = lo; r < hi; ++r, S = next_combination(S)) {
+                for (std::size_t rest = S; rest; rest &= rest - 1) {
+                    const std::size_t j = __builtin_ctzll(rest);
+                    const std::size_t prev_S = S & ~(std::size_t(1) << j);
+                    const value_t * prev = &dp[prev_S * m];
+                    value_t best = INF;
+                    for (std::size_t from = prev_S; from; from &= from - 1) {
+                        const std::size_t i = __builtin_ctzll(from);
+                        best = std::min<value_t>(best, prev[i] + day_arcs[i * m + j]);
+                    }
+                    dp[S * m + j] = best;
+                }
+            }
+        });
+    }
+
+    value_t best = INF;
+    std::size_t last = 0;
+    for (std::size_t j = 0; j < m; ++j) {
+        const cost_t cost = costs(n-1, cities[j], start);
+        if (cost != NO_ARC && dp[full * m + j] + value_t(cost) < best) {
+            best = dp[full * m + j] + value_t(cost);
+            last = j;
+        }
+    }
+    if (best >= INF) {
+        return std::numeric_limits<cost_t>::max();
+    }
+
+    // walk the optimal path back from its end
+    tour.assign(n + 1, start);
+    std::size_t S = full;
+    std::size_t j = last;
+    for (std::size_t p = m; ; --p) {
+        tour[p] = cities[j];
+        const std::size_t prev_S = S & ~(std::size_t(1) << j);
+        if (prev_S == 0) {
+            break;
+        }
+        const value_t * day_arcs = &arc[(p - 1) * m * m];
+        for (std::size_t from = prev_S; from; from &= from - 1) {
+            const std::size_t i = __builtin_ctzll(from);
+            if (dp[prev_S * m + i] + day_arcs[i * m + j] == dp[S * m + j]) {
+                j = i;
+                break;
+            }
+        }
+        S = prev_S;
+    }
+    return best;
+}
+
+
+// Find an optimal tour of the n cities into `tour` and return its cost
+// (the maximal cost_t if there is no tour at all) in `cost`. Return false
+// without solving when the table would take more than HELD_KARP_BYTES, and
+// false as well when it is not done by `deadline`.
+template<typename costs_t>
+bool held_karp(const std::size_t n,
+               const cid_t start,
+               const costs_t & costs,
+               ThreadPool & pool,
+               std::chrono::steady_clock::time_point deadline,
+               std::vector<cid_t> & tour,
+               cost_t & cost)
+{
+    cost_t max_arc = 0;
+    for (cid_t day = 0; day < n; ++day) {
+        for (cid_t from = 0; from < n; ++from) {
+            const auto * row = costs.row(day, from);
+            for (cid_t to = 0; to < n; ++to) {
+                max_arc = std::max<cost_t>(max_arc, row[to]);
+            }
+        }
+    }
+    // whether any tour and twice the unreachable INF fit into 32 bits
+    const bool narrow = max_arc * cost_t(n) < cost_t(std::numeric_limits<std::uint32_t>::max() / 2);
+    const std::size_t width = narrow ? sizeof(std::uint32_t) : sizeof(std::uint64_t);
+    if (held_karp_bytes(n, width) > HELD_KARP_BYTES) {
+        return false;
+    }
+
+    const auto start_time = std::chrono::steady_clock::now();
+    if (narrow) {
+        cost = held_karp_tables<std::uint32_t>(n, start, costs, pool, deadline, tour);
+    } else {
+        cost = held_karp_tables<std::uint64_t>(n, start, costs, pool, deadline, tour);
+    }
+    if (PRINT_STATS) {
+        const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+        std::cerr << "held-karp: " << held_karp_bytes(n, width) / width
+                  << " states in " << seconds << " s"
+                  << (cost < 0 ? ", out of time" : "") << std::endl;
+    }
+    return cost >= 0;
+}
+
+#endif
+// vim: set tabstop=4 expandtab shiftwidth=4 softtabstop=4 shiftround
@@ -0,0 +1,229 @@
+#ifndef LOWER_BOUND_HPP_
+#define LOWER_BOUND_HPP_
+
+#include<vector>
+#include<limits>
+#include<cmath>
+
+#include "common.hpp"
+
+// the usual subgradient settings, not tuned on the instances
+constexpr double BOUND_LAMBDA{2.0};  // initial subgradient step scale
+constexpr double BOUND_MIN_LAMBDA{1e-4};  // converged below it
+constexpr std::size_t BOUND_PATIENCE{20};  // steps without a better bound before halving
+constexpr double BOUND_INF{1e13};  // cost of the impossible assignments
+
+
+/* Lagrangian lower bound
+ *
+ * A tour flies on every day d one arc (d, i, j), so that every city is left
+ * once and entered once, and a city entered on day d is left on day d+1.
+ * With multipliers u[j] for entering j once and v[d * n + j] for leaving j
+ * on day d+1 exactly when entering it on day d, an arc costs
+ *   cost(d, i, j) - u[j] + v[d * n + j] - v[(d-1) * n + i]
+ * (the v terms only where the days exist) and the remaining problem, leaving
+ * every city on a different day by its cheapest arc, is an assignment of
+ * the days to the cities. The sum of u and the cost of the optimal
+ * assignment is a lower bound of every tour for any multipliers. They are
+ * improved by subgradient steps toward the best known tour.
+ */
+
+
+// Optimal assignment of the n columns to the n rows of the matrix
+// a[row * n + col] (Hungarian method with potentials, O(n^3)). The column
+// of every row is put into `col_of_row`, its cost returned.
+double assignment(const std::vector<double> & a, std::size_t n, std::vector<std::size_t> & col_of_row)
+{
+    constexpr double INF = std::numeric_limits<double>::infinity();
+    // 1-based, row_of[0] and col 0 are the free row being added
+    std::vector<double> u(n + 1, 0), v(n + 1, 0), min_v(n + 1);
+    std::vector<std::size_t> row_of(n + 1, 0), way(n + 1, 0);
+    std::vector<char> used(n + 1);
+    for (std::size_t row = 1; row <= n; ++row) {
+        row_of[0] = row;
+        std::size_t col = 0;
+        std::fill(min_v.begin(), min_v.end(), INF);
+        std::fill(used.begin(), used.end(), 0);
+        do {
+            used[col] = 1;
+            const std::size_t r = row_of[col];
+            const double * a_row = &a[(r - 1) * n];
+            double delta = INF;
+            std::size_t next = 0;
+            for (std::size_t c = 1; c <= n; ++c) {
+                if (used[c]) {
+                    continue;
+                }
+                const double reduced = a_row[c - 1] - u[r] - v[c];
+                if (reduced < min_v[c]) {
+                    min_v[c] = reduced;
+                    way[c] = col;
+                }
+                if (min_v[c] < delta) {
+                    delta = min_v[c];
+                    next = c;
+                }
+            }
+            for (std::size_t c = 0; c <= n; ++c) {
+                if (used[c]) {
+                    u[row_of[c]] += delta;
+                    v[c] -= delta;
+                } else {
+                    min_v[c] -= delta;
+                }
+            }
+            col = next;
+        } while (row_of[col] != 0);
+        do {
+            const std::size_t prev = way[col];
+            row_of[col] = row_of[prev];
+            col = prev;
+        } while (col);
+    }
+
+    col_of_row.assign(n, 0);
+    double cost = 0;
+    for (std::size_t c = 1; c <= n; ++c) {
+        col_of_row[row_of[c] - 1] = c - 1;
+        cost += a[(row_of[c] - 1) * n + c - 1];
+    }
+    return cost;
+}
+
+
+// The Lagrangian bound, improved a subgradient step at a time by `improve`.
+template<typename costs_t>
+class LowerBound {
+    const std::size_t n;
+    const cid_t start;
+    const Graph<costs_t> & graph;
+    std::vector<double> u;
+    std::vector<double> v;
+    std::vector<double> leave;  // leave[city * n + day]: cheapest with the multipliers
+    std::vector<cid_t> target;  // of the cheapest arc
+    std::vector<std::size_t> day_of;
+    std::vector<double> g_u;
+    std::vector<double> g_v;
+    double lambda = BOUND_LAMBDA;
+    double best_L = -std::numeric_limits<double>::infinity();
+    std::size_t stall = 0;
+    cost_t bound_ = 0;
+    std::size_t steps_ = 0;
+
+public:
+    LowerBound(std::size_t n, cid_t start, const Graph<costs_t> & graph) :
+        n(n),
+        start(start),
+        graph(graph),
+        u(n, 0),
+        v(n * n, 0),
+        leave(n * n),
+        target(n * n),
+        g_u(n),
+        g_v(n * n)
+    {}
+
+    // the best bound so far, the maximal cost_t if there is no tour at all
+    cost_t bound() const
+    {
+        return bound_;
+    }
+
+    std::size_t steps() const
+    {
+        return steps_;
+    }
+
+    // whether more steps would not improve the bound noticeably
+    bool converged() const
+    {
+        return lambda < BOUND_MIN_LAMBDA;
+    }
+
+    // One subgradient step, aimed at the cost `upper` of the best known
+    // tour (the maximal cost_t if there is none).
+    void improve(cost_t upper)
+    {
+        steps_++;
+        for (cid_t city = 0; city < n; ++city) {
+            for (cid_t day = 0; day < n; ++day) {
+                double & cheapest = leave[city * n + day];
+                cheapest = BOUND_INF;
+                // start is left on day 0, the other cities later
+                if ((city == start) != (day == 0)) {
+                    continue;
+                }
+                const double arrival = day > 0 ? v[(day - 1) * n + city] : 0;
+                for (const auto & arc : graph.out_arcs(day, city)) {
+                    double cost = arc.cost - u[arc.city] - arrival;
+                    if (std::size_t(day) + 1 < n) {
+                        cost += v[day * n + arc.city];
+                    }
+                    if (cost < cheapest) {
+                        cheapest = cost;
+                        target[city * n + day] = arc.city;
+                    }
+                }
+            }
+        }
+
+        double L = assignment(leave, n, day_of);
+        if (L >= BOUND_INF / 2) {
+            bound_ = std::numeric_limits<cost_t>::max();
+            lambda = 0;
+            return;
+        }
+        for (std::size_t j = 0; j < n; ++j) {
+            L += u[j];
+        }
+        // tours cost whole numbers, L is rounded up only beyond the error of
+        // summing it in doubles
+        bound_ = std::max(bound_, cost_t(std::ceil(L - (1e-9 * std::abs(L) + 1e-6))));
+        if (L > best_L + 1e-9) {
+            best_L = L;
+            stall = 0;
+        } else if (++stall >= BOUND_PATIENCE) {
+            lambda /= 2;
+            stall = 0;
+        }
+
+        std::fill(g_u.begin(), g_u.end(), 1);
+        std::fill(g_v.begin(), g_v.end(), 0);
+        for (cid_t city = 0; city < n; ++city) {
+            const std::size_t day = day_of[city];
+            const cid_t to = target[city * n + day];
+            g_u[to] -= 1;
+            if (day + 1 < n) {
+                g_v[day * n + to] += 1;
+            }
+            if (day > 0) {
+                g_v[(day - 1) * n + city] -= 1;
+            }
+        }
+        double norm = 0;
+        for (double g : g_u) {
+            norm += g * g;
+        }
+        for (double g : g_v) {
+            norm += g * g;
+        }
+        // the cheapest arcs form a tour, which is then an optimal one
+        if (norm == 0) {
+            lambda = 0;
+            return;
+        }
+
+        const double goal = upper != std::numeric_limits<cost_t>::max() ?
+            double(upper) : L + std::abs(L) * 0.05 + 1;
+        const double step = lambda * std::max(goal - L, 1.0) / norm;
+        for (std::size_t j = 0; j < n; ++j) {
+            u[j] += step * g_u[j];
+        }
+        for (std::size_t i = 0; i < v.size(); ++i) {
+            v[i] += step * g_v[i];
+        }
+    }
+};
+
+#endif
+// vim: set tabstop=4 expandtab shiftwidth=4 softtabstop=4 shiftround
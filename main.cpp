@@ -3,24 +3,152 @@
 #include <thread>
 #include <chrono>
 #include <algorithm>
+#include <atomic>
 #include "common.hpp"
 #include "dp_heuristic.hpp"
+#include "directions.hpp"
 #include "random_perturbations.hpp"
+#include "window_search.hpp"
+#include "held_karp.hpp"
+#include "lower_bound.hpp"
+#include "thread_pool.hpp"
 
-int main()
+// DP run number `schedule` of `schedules` with visited sets of N bits and
+// keeper_t
+template<typename keeper_t, typename costs_t>
+void run_schedule(const Options & options,
+                  const int n,
+                  const cid_t start,
+                  const Graph<costs_t> & graph,
+                  unsigned int H,
+                  unsigned int H_max,
+                  std::chrono::steady_clock::time_point end_time,
+                  const std::vector<std::vector<int>> & schedules,
+                  const std::size_t schedule,
+                  std::vector<cid_t> & best_tour,
+                  ThreadPool & pool,
+                  unsigned int threads,
+                  Incumbent * incumbent)
 {
-    auto start_time = std::chrono::steady_clock::now();
-    auto end_time = start_time + std::chrono::milliseconds(30 * 1000 - 200);
-    std::ios::sync_with_stdio(false);
+    if (options.meet) {
+        // the schedules differ by the day the two halves meet
+        const cid_t m = (schedule + 1) * (n - 1) / (schedules.size() + 1);
+        dp_meet_in_middle<keeper_t>(n, start, graph, H, H_max, end_time,
+                                    m, best_tour, pool, threads, options.bound, incumbent);
+    } else {
+        dp_heuristic<keeper_t>(n, start, graph, H, H_max, end_time,
+                               schedules[schedule], best_tour, pool, threads,
+                               options.bound, incumbent);
+    }
+}
+
+template<std::size_t N, typename costs_t>
+void run_dp(const Options & options,
+            const int n,
+            const cid_t start,
+            const Graph<costs_t> & graph,
+            unsigned int H,
+            unsigned int H_max,
+            std::chrono::steady_clock::time_point end_time,
+            const std::vector<std::vector<int>> & schedules,
+            const std::size_t schedule,
+            std::vector<cid_t> & best_tour,
+            ThreadPool & pool,
+            unsigned int threads,
+            Incumbent * incumbent)
+{
+    if (options.batch_select) {
+        run_schedule<BatchKeeper<N>>(options, n, start, graph, H, H_max, end_time,
+                                     schedules, schedule, best_tour, pool, threads, incumbent);
+    } else {
+        run_schedule<Keeper<N>>(options, n, start, graph, H, H_max, end_time,
+                                schedules, schedule, best_tour, pool, threads, incumbent);
+    }
+}
+
+// memory of a DP run with visited sets of N bits per pt of H_max
+template<std::size_t N, typename costs_t>
+std::size_t dp_bytes_per_pt(const Options & options, const int n, unsigned int threads)
+{
+    const std::size_t bytes = options.batch_select ?
+        BeamSearch<BatchKeeper<N>, costs_t>::bytes_per_pt(n, threads) :
+        BeamSearch<Keeper<N>, costs_t>::bytes_per_pt(n, threads);
+    // meeting in the middle grows two searches
+    return options.meet ? 2 * bytes : bytes;
+}
 
-    id_t n;
-    cid_t start;
-    Cities cities;
-    costs_table_t costs;
-    init_from_input(start, cities, costs);
-    n = cities.size();
 
-    // XXX reevaluate
+// Print the cost of the tour found by the DP with the first schedule and
+// a fixed beam width H, for H doubling up to H_max, to see what quality
+// each H buys.
+template<typename costs_t, typename dp_t>
+void sweep_beam(const int n,
+                const cid_t start,
+                const Graph<costs_t> & graph,
+                const Options & options,
+                const std::vector<std::vector<int>> & schedules,
+                const unsigned int H_max,
+                ThreadPool & pool,
+                const unsigned int threads,
+                dp_t dp)
+{
+    const auto no_deadline = std::chrono::steady_clock::time_point::max();
+    std::cout << "H\tcost\tms" << std::endl;
+    for (unsigned int H = 1; ; H = std::min(2 * H, H_max)) {
+        std::vector<cid_t> tour;
+        const auto begin = std::chrono::steady_clock::now();
+        dp(options, n, start, graph, H, H, no_deadline, schedules, 0, tour, pool, threads, nullptr);
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - begin).count();
+        std::cout << H << "\t";
+        if (tour.empty()) {
+            std::cout << "-";
+        } else {
+            std::cout << tour_cost(graph.costs, tour);
+        }
+        std::cout << "\t" << ms << std::endl;
+        if (H == H_max) {
+            break;
+        }
+    }
+}
+
+
+constexpr std::size_t DENSE_DEGREE = 16;
+constexpr std::size_t DP_BYTES = std::size_t(1) << 30;  // of the DP runs at a time
+constexpr std::chrono::milliseconds GAP_POLL{10};  // once the bound is done
+
+
+template<typename costs_t>
+int solve(const id_t n,
+          const cid_t start,
+          const Cities & cities,
+          const std::vector<IOArc> & input_arcs,
+          const Options & options,
+          std::chrono::steady_clock::time_point end_time)
+{
+    Graph<costs_t> graph;
+    init_from_input(n, start, input_arcs, graph.costs);
+    const std::size_t pruned = prune_costs(n, start, graph.costs);
+    graph.out_arcs = costs_t::arcs_t::outgoing(graph.costs);
+    graph.in_arcs = costs_t::arcs_t::incoming(graph.costs);
+    const costs_t & costs = graph.costs;
+    const auto & out_arcs = graph.out_arcs;
+
+    // scanning whole rows pays off once a city has about n/DENSE_DEGREE
+    // arcs a day
+    graph.dense = options.dense >= 0 ?
+        options.dense : out_arcs.size() * DENSE_DEGREE >= std::size_t(n) * n * n;
+    if (graph.dense) {
+        graph.costs_T = costs.transposed();
+    }
+    if (PRINT_STATS) {
+        std::cerr << "pruned " << pruned << " arcs, "
+                  << out_arcs.size() << " remaining, "
+                  << (graph.dense ? "dense" : "sparse") << " expansion" << std::endl;
+    }
+
+    // initial beam width, BeamController adapts it to the measured speed
     unsigned int H;
     if (n <= 20) {
         H = 175000;
@@ -40,31 +168,206 @@ int main()
         H = 1000;
     }
 
-    std::vector<std::vector<cid_t>> tours(CPU_COUNT);
-#pragma omp parallel for
-    for (std::size_t i = 0; i < CPU_COUNT; ++i) {
-        dp_heuristic(n, start, costs, H, end_time, DIRECTIONS[i], tours[i]);
+    // The DP schedules, their layers and the local searches all run on it.
+    // The main thread computes the lower bound meanwhile, so unless that is
+    // off, the pool leaves it a core.
+    const unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    ThreadPool pool(options.threads ? options.threads :
+                    options.gap >= 0 && cores > 1 ? cores - 1 : cores);
+
+    auto print_tour = [&](const std::vector<cid_t> & tour, const cost_t cost) {
+        output_t output_arcs(n);
+        for (cid_t t = 0; t < n; ++t) {
+            cid_t from = tour[t];
+            cid_t to = tour[t+1];
+            output_arcs[t] = IOArc(from, to, t, costs(t, from, to));
+        }
+        print_output(output_arcs, cost, cities, n);
+    };
+
+    // Small instances are solved exactly when the table fits into memory.
+    // Should that take over half of the time, the heuristic gets the rest.
+    if (!options.heuristic && !options.sweep) {
+        std::vector<cid_t> tour;
+        cost_t cost;
+        const auto now = std::chrono::steady_clock::now();
+        if (held_karp(n, start, costs, pool, now + (end_time - now) / 2, tour, cost)) {
+            if (cost != std::numeric_limits<cost_t>::max()) {
+                print_tour(tour, cost);
+            }
+            return 0;
+        }
     }
 
-    std::vector<std::thread> threads;
-    std::vector<cost_t> outputs(CPU_COUNT, std::numeric_limits<cost_t>::max());
-    for (std::size_t i = 0; i < CPU_COUNT; ++i) {
-        const std::size_t ii = i;
-        if (tours[ii].empty()) {
-            outputs[ii] = std::numeric_limits<cost_t>::max();
-        } else {
-            threads.emplace_back(
-                std::thread(random_perturbations, n,
-                            std::ref(tours[ii]),
-                            std::ref(costs),
-                            std::ref(outputs[ii])));
+    // A schedule per SCHEDULE_CORES workers, so that more cores search more
+    // diversely, while the layers of each run are still sharded.
+    const std::size_t count = options.schedules ? options.schedules :
+        std::max<std::size_t>(MIN_SCHEDULES, pool.size() / SCHEDULE_CORES);
+    const auto schedules = direction_schedules(n, count, graph);
+
+    // the cores left over by the schedules help with the layers
+    unsigned int dp_threads = options.dp_threads;
+    if (dp_threads == 0) {
+        dp_threads = std::max(1u, pool.size() / unsigned(count));
+    }
+
+    // When there are fewer workers than schedules, the schedules run in
+    // rounds, each of which gets its share of the time for the DP.
+    const unsigned int team = std::min<unsigned int>(pool.size(), count);
+    const unsigned int rounds = (count + team - 1) / team;
+    const auto dp_start_time = std::chrono::steady_clock::now();
+    const auto dp_time = (end_time - dp_start_time) * options.dp_fraction;
+
+    // the narrowest visited sets which can hold all the cities
+    auto dp = run_dp<512, costs_t>;
+    auto bytes_per_pt = dp_bytes_per_pt<512, costs_t>;
+    if (n <= 64) {
+        dp = run_dp<64, costs_t>;
+        bytes_per_pt = dp_bytes_per_pt<64, costs_t>;
+    } else if (n <= 128) {
+        dp = run_dp<128, costs_t>;
+        bytes_per_pt = dp_bytes_per_pt<128, costs_t>;
+    } else if (n <= 256) {
+        dp = run_dp<256, costs_t>;
+        bytes_per_pt = dp_bytes_per_pt<256, costs_t>;
+    }
+
+    // Memory of the DP is allocated for the maximal beam width, by default
+    // the widest for which the runs of a round fit into DP_BYTES. H only
+    // is where BeamController starts.
+    unsigned int H_max = options.max_beam;
+    if (H_max == 0) {
+        const std::size_t widest = DP_BYTES / (team * bytes_per_pt(options, n, dp_threads));
+        H_max = std::max<std::size_t>(H, std::min<std::size_t>(widest, std::numeric_limits<int>::max()));
+    }
+
+    if (options.sweep) {
+        sweep_beam(n, start, graph, options, schedules, H_max, pool, dp_threads, dp);
+        return 0;
+    }
+
+    // Every schedule is a task, which hands its tour to a local search as
+    // soon as its DP is done, instead of waiting for the slowest one. The
+    // local searches run in the background, so a worker only takes one
+    // when there is no DP work left for it. Once the last schedule is done,
+    // the workers left over start local searches from the best tour too.
+    // The local searches share their best tours in `elite`.
+    //
+    // The DP runs publish greedily completed tours while they go, a
+    // schedule which found no tour starts from the best of those.
+    Incumbent incumbent;
+    ElitePool elite;
+    const std::size_t searches = std::max<std::size_t>(pool.size(), count);
+    std::vector<std::vector<cid_t>> tours(searches);
+    std::vector<cost_t> outputs(searches, std::numeric_limits<cost_t>::max());
+    TaskGroup dp_tasks;
+    TaskGroup search_tasks;
+    std::atomic<unsigned int> started{0};
+    std::atomic<unsigned int> finished{0};
+    std::atomic<unsigned int> submitted{0};
+
+    // the first local searches submitted reorder windows of the tour
+    auto local_search = [&](std::size_t i) {
+        outputs[i] = tour_cost(costs, tours[i]);
+        const bool windows = submitted++ < options.windows;
+        pool.submit([&, i, windows]() {
+            if (windows) {
+                window_search(n, tours[i], graph, end_time, elite, outputs[i]);
+            } else if (options.accept == ACCEPT_GREEDY) {
+                random_perturbations<Greedy>(n, tours[i], graph, end_time,
+                                             elite, outputs[i]);
+            } else if (options.accept == ACCEPT_LATE) {
+                random_perturbations<Late>(n, tours[i], graph, end_time,
+                                           elite, outputs[i]);
+            } else {
+                random_perturbations<Annealing>(n, tours[i], graph, end_time,
+                                                elite, outputs[i]);
+            }
+        }, search_tasks, true);
+    };
+    for (std::size_t i = 0; i < count; ++i) {
+        pool.submit([&, i]() {
+            // rounds in the order in which the schedules start
+            const unsigned int round = started++ / team;
+            const auto dp_end_time = dp_start_time +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    dp_time * (round + 1) / rounds);
+            // once the searches stop, the later schedules are not worth
+            // allocating their beams for
+            if (!TERMINATE.load()) {
+                dp(options, n, start, graph, H, H_max, dp_end_time,
+                   schedules, i, tours[i], pool, dp_threads, &incumbent);
+            }
+            if (!tours[i].empty()) {
+                incumbent.offer(tours[i], tour_cost(costs, tours[i]));
+            } else {
+                tours[i] = incumbent.tour();
+            }
+            if (!tours[i].empty()) {
+                local_search(i);
+            }
+            if (++finished == count) {
+                for (std::size_t j = count; j < searches; ++j) {
+                    tours[j] = incumbent.tour();
+                    if (!tours[j].empty()) {
+                        local_search(j);
+                    }
+                }
+            }
+        }, dp_tasks);
+    }
+
+    // Meanwhile the main thread bounds the cost of every tour from below and
+    // stops the searches as soon as the best tour is within the gap
+    // tolerated by the options (or there is no tour at all).
+    LowerBound<costs_t> lower(n, start, graph);
+    auto best_so_far = [&]() {
+        return std::min(incumbent.cost(), elite.best_cost());
+    };
+    auto gap_closed = [&]() {
+        const cost_t best = best_so_far();
+        const cost_t bound = lower.bound();
+        return bound == std::numeric_limits<cost_t>::max() ||
+            (options.gap >= 0 && best != std::numeric_limits<cost_t>::max() &&
+             best - bound <= options.gap * bound);
+    };
+    double step_seconds = 0;
+    while (!gap_closed()) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= end_time) {
+            break;
         }
+        const auto step_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(2 * step_seconds));
+        if (options.gap < 0 || lower.converged() || now + step_time >= end_time) {
+            std::this_thread::sleep_until(std::min<std::chrono::steady_clock::time_point>(
+                end_time, now + GAP_POLL));
+            continue;
+        }
+        lower.improve(best_so_far());
+        step_seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - now).count();
     }
-    std::this_thread::sleep_until(end_time);
     TERMINATE.store(true);
-    for (auto & thread : threads) {
-        thread.join();
+    if (PRINT_STATS) {
+        const cost_t best = best_so_far();
+        std::cerr << "lower bound ";
+        if (lower.bound() == std::numeric_limits<cost_t>::max()) {
+            std::cerr << "infinite";
+        } else {
+            std::cerr << lower.bound();
+        }
+        std::cerr << " after " << lower.steps() << " steps, ";
+        if (best == std::numeric_limits<cost_t>::max()) {
+            std::cerr << "no tour" << std::endl;
+        } else {
+            std::cerr << "best tour " << best << ", gap "
+                      << 100.0 * (best - lower.bound()) / std::max<cost_t>(1, lower.bound())
+                      << "%" << std::endl;
+        }
     }
+    pool.wait(dp_tasks);
+    pool.wait(search_tasks);
 
     cost_t best_cost = std::numeric_limits<cost_t>::max();
     std::size_t best_idx = 0;
@@ -76,12 +379,15 @@ int main()
         }
 #ifdef DEBUG
 #include <set>
+        if (tours[i].empty()) {
+            continue;
+        }
         std::set<cid_t> S;
         for (cid_t t = 0; t < n; ++t) {
             cid_t from = tours[i][t];
             cid_t to = tours[i][t+1];
             S.insert(from);
-            if (costs[t][from][to] == NO_ARC) {
+            if (costs(t, from, to) == NO_ARC) {
                 std::cerr << "NONEXISTENT FLIGHT!" << std::endl;
                 return 1;
             }
@@ -93,16 +399,52 @@ int main()
 #endif
     }
 
+    // a greedily completed tour may still be the best one
+    if (incumbent.cost() < best_cost) {
+        best_cost = incumbent.cost();
+        best_idx = tours.size();
+        tours.push_back(incumbent.tour());
+    }
+
     if (best_cost != std::numeric_limits<cost_t>::max()) {
-        output_t output_arcs(n);
-        for (cid_t t = 0; t < n; ++t) {
-            cid_t from = tours[best_idx][t];
-            cid_t to = tours[best_idx][t+1];
-            output_arcs[t] = IOArc(from, to, t, costs[t][from][to]);
-        }
-        print_output(output_arcs, best_cost, cities, n);
+        print_tour(tours[best_idx], best_cost);
     }
 
     return 0;
 }
+
+
+int main(int argc, char * argv[])
+{
+    auto start_time = std::chrono::steady_clock::now();
+    auto end_time = start_time + std::chrono::milliseconds(30 * 1000 - 200);
+    std::ios::sync_with_stdio(false);
+
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
+
+    cid_t start;
+    Cities cities;
+    std::vector<IOArc> input_arcs;
+    read_input(start, cities, input_arcs);
+    id_t n = cities.size();
+    if (n > MAX_N) {
+        std::cerr << "at most " << MAX_N << " cities are supported" << std::endl;
+        return 1;
+    }
+
+    if (!fits_cost_width<int32_t>(input_arcs)) {
+        std::cerr << "prices from 0 to " << std::numeric_limits<int32_t>::max()
+                  << " are supported" << std::endl;
+        return 1;
+    }
+
+    // the narrower the costs, the more of them fit into cache
+    if (fits_cost_width<int16_t>(input_arcs)) {
+        return solve<CostTable<int16_t>>(n, start, cities, input_arcs, options, end_time);
+    }
+    return solve<CostTable<int32_t>>(n, start, cities, input_arcs, options, end_time);
+}
 // vim: set tabstop=4 expandtab shiftwidth=4 softtabstop=4 shiftround
@@ -7,23 +7,425 @@
 #include <random>
 #include <atomic>
 #include <array>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <memory>
+#include <mutex>
 
 // XXX reevaluate
 constexpr std::size_t MAX_PERTURBATIONS{5};
+constexpr std::size_t MAX_BLOCK{3};  // cities moved together by or-opt
+constexpr std::size_t MAX_SHIFT{16};  // days a block moves by, or-opt
+constexpr std::size_t MAX_SEGMENT{24};  // cities of a rotated segment
  
-std::atomic<bool> TERMINATE{false};
 static thread_local std::random_device rd;
 static thread_local std::mt19937 g(rd());
 
+
+// A segment move: V[lo..hi] rotated left by r, so that V[lo+r] comes to lo.
+// Moving a block of k cities by s days forward is the rotation of the block
+// and the s cities after it by k, backward the rotation of the s cities
+// before it and the block by s.
+struct Rotation {
+    std::size_t lo;
+    std::size_t hi;
+    std::size_t r;
+};
+
+
+// Set `delta` to the change of the cost of V by `rot`. All the cities in the
+// segment fly on other days, but only the arcs of the days lo-1..hi change,
+// so only those are looked at. Returns false at the first arc which does
+// not exist.
+template<typename costs_t>
+bool rotation_delta(const std::vector<cid_t> & V,
+                    const costs_t & costs,
+                    const Rotation & rot,
+                    cost_t & delta)
+{
+    const std::size_t len = rot.hi - rot.lo + 1;
+    cid_t from = V[rot.lo - 1];
+    delta = 0;
+    for (std::size_t t = rot.lo; t <= rot.hi + 1; ++t) {
+        const cid_t to = t > rot.hi ? V[t] : V[rot.lo + (t - rot.lo + rot.r) % len];
+        const cost_t cost = costs(t-1, from, to);
+        if (cost == NO_ARC) {
+            return false;
+        }
+        delta += cost - costs(t-1, V[t-1], V[t]);
+        from = to;
+    }
+    return true;
+}
+
+
+// A random or-opt move of V (n+1 cities, the first and the last fixed),
+// false if the drawn one does not fit into the tour.
+template<typename rng_t>
+bool draw_or_opt(const std::size_t n, rng_t & g, Rotation & rot)
+{
+    std::uniform_int_distribution<std::size_t> dis_k(1, MAX_BLOCK);
+    std::uniform_int_distribution<std::size_t> dis_shift(1, MAX_SHIFT);
+    std::uniform_int_distribution<std::size_t> dis_days(1, n-1);
+    const std::size_t k = dis_k(g);
+    const std::size_t s = dis_shift(g);
+    const std::size_t i = dis_days(g);
+    if (g() % 2) {
+        rot = Rotation{i, i + k + s - 1, k};
+    } else {
+        rot = Rotation{i - std::min(i, s), i + k - 1, s};
+    }
+    return rot.lo >= 1 && rot.hi <= n-1;
+}
+
+
+// A random rotation of a segment of V, false if it does not fit.
+template<typename rng_t>
+bool draw_rotation(const std::size_t n, rng_t & g, Rotation & rot)
+{
+    std::uniform_int_distribution<std::size_t> dis_len(2, MAX_SEGMENT);
+    std::uniform_int_distribution<std::size_t> dis_days(1, n-1);
+    const std::size_t len = dis_len(g);
+    const std::size_t lo = dis_days(g);
+    std::uniform_int_distribution<std::size_t> dis_r(1, len-1);
+    rot = Rotation{lo, lo + len - 1, dis_r(g)};
+    return rot.hi <= n-1;
+}
+
+// For every position p of the tour (but the first and the last), the
+// cities which fit there: those with an arc from V[p-1] on day p-1 and an arc
+// to V[p+1] on day p. Swaps are drawn from it, so that only feasible ones
+// are proposed. When V changes, the changed positions and their neighbours
+// are marked stale and refreshed once they are drawn, as most changes are
+// rolled back before that.
+template<typename costs_t>
+class SwapIndex {
+    const Graph<costs_t> & graph;
+    std::vector<std::vector<cid_t>> fits;
+    std::vector<char> stale;
+    std::vector<std::size_t> partners;  // of the last draw
+
+    void refresh(const std::vector<cid_t> & V, std::size_t p)
+    {
+        // both lists of arcs are sorted by city
+        const auto in = graph.out_arcs(p-1, V[p-1]);
+        const auto out = graph.in_arcs(p, V[p+1]);
+        auto & cities = fits[p];
+        cities.clear();
+        auto a = in.begin();
+        auto b = out.begin();
+        while (a != in.end() && b != out.end()) {
+            if (a->city < b->city) {
+                ++a;
+            } else if (b->city < a->city) {
+                ++b;
+            } else {
+                cities.push_back(a->city);
+                ++a;
+                ++b;
+            }
+        }
+    }
+
+public:
+    SwapIndex(const Graph<costs_t> & graph, const std::vector<cid_t> & V) :
+        graph(graph),
+        fits(V.size() - 1),
+        stale(V.size(), true)
+    {}
+
+    // V[lo..hi] changed
+    void changed(std::size_t lo, std::size_t hi)
+    {
+        std::fill(stale.begin() + (lo - 1), stale.begin() + (hi + 2), true);
+    }
+
+    // Draw a position q whose city can be swapped with the one at p, false
+    // if there is none. Neighbouring positions are left to the segment
+    // moves.
+    template<typename rng_t>
+    bool draw(const std::vector<cid_t> & V,
+              const std::vector<std::size_t> & pos,
+              std::size_t p,
+              rng_t & g,
+              std::size_t & q)
+    {
+        const auto & costs = graph.costs;
+        if (stale[p]) {
+            refresh(V, p);
+            stale[p] = false;
+        }
+        partners.clear();
+        for (cid_t city : fits[p]) {
+            const std::size_t r = pos[city];
+            if (r >= 1 && (r + 1 < p || r > p + 1)) {
+                if (costs(r-1, V[r-1], V[p]) != NO_ARC && costs(r, V[p], V[r+1]) != NO_ARC) {
+                    partners.push_back(r);
+                }
+            }
+        }
+        if (partners.empty()) {
+            return false;
+        }
+        std::uniform_int_distribution<std::size_t> dis(0, partners.size() - 1);
+        q = partners[dis(g)];
+        return true;
+    }
+};
+
+
+// Moves of a local search: drawn, feasible (all their arcs exist) and made.
+struct MoveStats {
+    std::size_t proposed = 0;
+    std::size_t feasible = 0;
+    std::size_t accepted = 0;
+
+    void print(double seconds) const
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(0)
+            << "local search: " << proposed / seconds << " proposed, "
+            << feasible / seconds << " feasible, "
+            << accepted / seconds << " accepted moves/s" << std::endl;
+        std::cerr << out.str();
+    }
+};
+
+
+/* Acceptance policies
+ *
+ * A policy decides whether the tour of cost `current` changes into one of
+ * cost `cost` by accept(current, cost, g). update(progress) is called every
+ * now and then with the part of the time of the local search which has
+ * passed, from 0 to 1.
+ */
+
+// tried on q50 and q100, hotter starts wander off and end no better
+constexpr double ANNEAL_START{0.1};  // initial temperature, of the mean arc cost
+constexpr double ANNEAL_END{0.001};  // final temperature, of the mean arc cost
+constexpr std::size_t LATE_HISTORY{2000};  // costs remembered by Late
+
+
+// accept no worse tours only
+class Greedy {
+public:
+    Greedy(std::size_t, cost_t) {}
+
+    void update(double) {}
+
+    template<typename rng_t>
+    bool accept(cost_t current, cost_t cost, rng_t &)
+    {
+        return cost <= current;
+    }
+};
+
+
+// Simulated annealing: a worse tour is accepted with the probability
+// exp(-(cost - current) / T). The temperature T falls exponentially from
+// ANNEAL_START to ANNEAL_END of the mean arc cost of the initial tour as
+// the time runs out.
+class Annealing {
+    double T_start;
+    double T_end;
+    double T;
+    std::uniform_real_distribution<double> uniform{0, 1};
+
+public:
+    Annealing(std::size_t n, cost_t cost) :
+        T_start(ANNEAL_START * cost / n),
+        T_end(ANNEAL_END * cost / n),
+        T(T_start)
+    {}
+
+    void update(double progress)
+    {
+        T = T_start * std::pow(T_end / T_start, std::min(1.0, progress));
+    }
+
+    template<typename rng_t>
+    bool accept(cost_t current, cost_t cost, rng_t & g)
+    {
+        return cost <= current || (T > 0 && uniform(g) < std::exp((current - cost) / T));
+    }
+};
+
+
+// Late acceptance hill climbing: a tour is accepted if it is no worse than
+// the current one or than the one LATE_HISTORY decisions ago. Every decision
+// remembers the cost of the tour it leaves current.
+class Late {
+    std::vector<cost_t> history;
+    std::size_t i = 0;
+
+public:
+    Late(std::size_t, cost_t cost) :
+        history(LATE_HISTORY, cost)
+    {}
+
+    void update(double) {}
+
+    template<typename rng_t>
+    bool accept(cost_t current, cost_t cost, rng_t &)
+    {
+        cost_t & late = history[i++ % history.size()];
+        const bool accepted = cost <= current || cost <= late;
+        late = accepted ? cost : current;
+        return accepted;
+    }
+};
+
+
+constexpr std::size_t ELITE_SIZE{4};  // tours shared by the local searches
+constexpr std::size_t STALL_ITERATIONS{1 << 20};  // without a new best, then restart
+constexpr std::size_t RESTART_KICKS{3};  // random swaps made to a restarted tour
+
+
+// The best few tours found by the local searches, shared among them.
+//
+// Every slot holds an immutable snapshot of a tour, which is replaced as a
+// whole. The mutex of a slot is held only to copy or swap the pointer to
+// its snapshot, never while a tour is copied, so a reader always gets a
+// whole tour. Publishing never waits: it only try_locks the slots and
+// skips the busy ones, a tour not put in because of that is simply offered
+// again with the next improvement.
+class ElitePool {
+    struct Elite {
+        cost_t cost;
+        std::vector<cid_t> tour;
+    };
+
+    struct Slot {
+        mutable std::mutex mutex;
+        std::shared_ptr<const Elite> elite;
+    };
+
+    std::array<Slot, ELITE_SIZE> slots;
+
+    std::shared_ptr<const Elite> load(const Slot & slot) const
+    {
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        return slot.elite;
+    }
+
+public:
+    // Put the tour in place of the worst one, if it is better and its cost
+    // is not in the pool yet (it is most likely the same tour). Returns
+    // whether it was put in.
+    bool publish(const std::vector<cid_t> & tour, cost_t cost)
+    {
+        std::size_t worst = slots.size();
+        std::shared_ptr<const Elite> expected;
+        cost_t worst_cost = -1;
+        for (std::size_t i = 0; i < slots.size(); ++i) {
+            std::unique_lock<std::mutex> lock(slots[i].mutex, std::try_to_lock);
+            if (!lock) {
+                continue;
+            }
+            const auto & elite = slots[i].elite;
+            const cost_t slot_cost = elite ? elite->cost : std::numeric_limits<cost_t>::max();
+            if (slot_cost == cost) {
+                return false;
+            }
+            if (slot_cost > worst_cost) {
+                worst = i;
+                worst_cost = slot_cost;
+                expected = elite;
+            }
+        }
+        if (worst == slots.size() || cost >= worst_cost) {
+            return false;
+        }
+        auto desired = std::make_shared<const Elite>(Elite{cost, tour});
+        // unless another search is replacing it or has replaced it meanwhile
+        std::unique_lock<std::mutex> lock(slots[worst].mutex, std::try_to_lock);
+        if (!lock || slots[worst].elite != expected) {
+            return false;
+        }
+        slots[worst].elite = std::move(desired);
+        return true;
+    }
+
+    // copy a random one of the tours to `tour`, false if there is none
+    template<typename rng_t>
+    bool draw(rng_t & g, std::vector<cid_t> & tour) const
+    {
+        std::vector<std::shared_ptr<const Elite>> elites;
+        for (const auto & slot : slots) {
+            auto elite = load(slot);
+            if (elite) {
+                elites.push_back(std::move(elite));
+            }
+        }
+        if (elites.empty()) {
+            return false;
+        }
+        std::uniform_int_distribution<std::size_t> dis(0, elites.size() - 1);
+        tour = elites[dis(g)]->tour;
+        return true;
+    }
+
+    // the cost of the best tour, the maximal cost_t if there is none
+    cost_t best_cost() const
+    {
+        cost_t best = std::numeric_limits<cost_t>::max();
+        for (const auto & slot : slots) {
+            const auto elite = load(slot);
+            if (elite) {
+                best = std::min(best, elite->cost);
+            }
+        }
+        return best;
+    }
+};
+
+
+// Improve the tour V by random moves until TERMINATE, expected around
+// `end_time`, deciding about them by accept_t. The working tour wanders
+// off by the worse moves accepted, the best one seen is kept aside and
+// returned in V, its cost in `output`.
+//
+// The best tours are published to `elite`. A search which has not found a
+// better tour for STALL_ITERATIONS restarts from a random elite tour,
+// kicked by a few random swaps.
+template<typename accept_t, typename costs_t>
 void random_perturbations(const std::size_t n,
                           std::vector<cid_t> & V,
-                          const costs_table_t & costs,
+                          const Graph<costs_t> & graph,
+                          std::chrono::steady_clock::time_point end_time,
+                          ElitePool & elite,
                           cost_t & output)
 {
-    cost_t best_cost{};
+    const costs_t & costs = graph.costs;
+    const auto start_time = std::chrono::steady_clock::now();
+    MoveStats stats;
+
+    cost_t current{};
     for (cid_t t = 0; t < n; ++t) {
-        best_cost += costs[t][V[t]][V[t+1]];
+        current += costs(t, V[t], V[t+1]);
+    }
+    cost_t best_cost = current;
+    std::vector<cid_t> best_V = V;
+    accept_t acceptance(n, current);
+    const double seconds = std::chrono::duration<double>(end_time - start_time).count();
+
+    // pos[city] = position of city in V
+    std::vector<std::size_t> pos(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        pos[V[i]] = i;
     }
+    SwapIndex<costs_t> index(graph, V);
+    elite.publish(V, current);
+    std::size_t last_best = 0;  // iteration
+    auto swap_cities = [&V, &pos, &index](std::size_t a, std::size_t b) {
+        std::swap(V[a], V[b]);
+        pos[V[a]] = a;
+        pos[V[b]] = b;
+        index.changed(a, a);
+        index.changed(b, b);
+    };
 
     std::random_device rd;
     std::mt19937 g(rd());
@@ -31,56 +433,107 @@ void random_perturbations(const std::size_t n,
     std::uniform_int_distribution<> dis_k(1, MAX_PERTURBATIONS);
     std::array<std::size_t, 2 * MAX_PERTURBATIONS> inds;
 
-    while (!TERMINATE.load()) {
-        std::size_t k = 2 * dis_k(g);
-        std::size_t rollback_k{k};
-        for (std::size_t i = 0; i < k; ++i) {
-            inds[i] = dis_days(g);
+    for (std::size_t iteration = 0; !TERMINATE.load(); ++iteration) {
+        if (current < best_cost) {
+            best_cost = current;
+            best_V = V;
+            last_best = iteration;
+            elite.publish(V, current);
         }
-        cost_t cost = best_cost;
-        for (std::size_t i = 0; i < k; i += 2) {
-            std::size_t & p1 = inds[i];
-            std::size_t & p2 = inds[i+1];
-            if (p1 == p2) {
-                continue;
+        if (iteration - last_best > STALL_ITERATIONS && elite.draw(g, V)) {
+            last_best = iteration;
+            for (std::size_t i = 1; i < n; ++i) {
+                pos[V[i]] = i;
             }
-            if (p2 - p1 == 1) {
-                std::swap(p1, p2);
+            index.changed(1, n-1);
+            for (std::size_t kick = 0; kick < RESTART_KICKS; ++kick) {
+                std::size_t p1 = dis_days(g);
+                std::size_t p2;
+                if (index.draw(V, pos, p1, g, p2)) {
+                    swap_cities(p1, p2);
+                }
             }
-            auto c11 = costs[p1-1][V[p1-1]][V[p1]];
-            auto c12 = costs[p1][V[p1]][V[p1+1]];
-            auto c21 = costs[p2-1][V[p2-1]][V[p2]];
-            auto c22 = costs[p2][V[p2]][V[p2+1]];
-            if (p1 - p2 == 1) {
-                cost -= c21 + c11 + c12;
-            } else {
-                cost -= c21 + c22 + c11 + c12;
+            current = 0;
+            for (cid_t t = 0; t < n; ++t) {
+                current += costs(t, V[t], V[t+1]);
             }
-            std::swap(V[p1], V[p2]);
-            c11 = costs[p1-1][V[p1-1]][V[p1]];
-            c12 = costs[p1][V[p1]][V[p1+1]];
-            c21 = costs[p2-1][V[p2-1]][V[p2]];
-            c22 = costs[p2][V[p2]][V[p2+1]];
-            if (c11 == NO_ARC || c12 == NO_ARC || c21 == NO_ARC || c22 == NO_ARC) {
-                rollback_k = i + 2;
-                goto rollback;
+        }
+        if (iteration % 1024 == 0) {
+            const double passed = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start_time).count();
+            acceptance.update(seconds > 0 ? passed / seconds : 1.0);
+        }
+
+        // Every other move is a segment move, evaluated before it is made,
+        // so that a move which fails needs no rollback.
+        if (n >= 3 && g() % 2) {
+            Rotation rot;
+            cost_t delta;
+            const bool drawn = g() % 2 ? draw_or_opt(n, g, rot) : draw_rotation(n, g, rot);
+            if (!drawn) {
+                continue;
             }
-            if (p1 - p2 == 1) {
-                cost += c21 + c11 + c12;
-            } else {
-                cost += c21 + c22 + c11 + c12;
+            stats.proposed++;
+            if (!rotation_delta(V, costs, rot, delta)) {
+                continue;
+            }
+            stats.feasible++;
+            if (acceptance.accept(current, current + delta, g)) {
+                std::rotate(V.begin() + rot.lo, V.begin() + rot.lo + rot.r, V.begin() + rot.hi + 1);
+                for (std::size_t p = rot.lo; p <= rot.hi; ++p) {
+                    pos[V[p]] = p;
+                }
+                index.changed(rot.lo, rot.hi);
+                current += delta;
+                stats.accepted++;
             }
+            continue;
         }
-        if (cost <= best_cost) {
-            best_cost = cost;
+
+        // k/2 swaps, each drawn from the index as it is after the previous
+        // ones, so all of them are feasible
+        std::size_t k = 2 * dis_k(g);
+        std::size_t swaps = 0;
+        cost_t cost = current;
+        for (std::size_t i = 0; i < k; i += 2) {
+            std::size_t & p1 = inds[i];
+            std::size_t & p2 = inds[i+1];
+            p1 = dis_days(g);
+            stats.proposed++;
+            if (!index.draw(V, pos, p1, g, p2)) {
+                p2 = p1;
+                continue;
+            }
+            stats.feasible++;
+            swaps++;
+            cost -= costs(p1-1, V[p1-1], V[p1]) + costs(p1, V[p1], V[p1+1]) +
+                    costs(p2-1, V[p2-1], V[p2]) + costs(p2, V[p2], V[p2+1]);
+            swap_cities(p1, p2);
+            cost += costs(p1-1, V[p1-1], V[p1]) + costs(p1, V[p1], V[p1+1]) +
+                    costs(p2-1, V[p2-1], V[p2]) + costs(p2, V[p2], V[p2+1]);
+        }
+        // nothing moved, nothing to decide (Late would remember the cost)
+        if (swaps == 0) {
+            continue;
+        }
+        if (acceptance.accept(current, cost, g)) {
+            current = cost;
+            stats.accepted += swaps;
         } else {
-rollback:
-            for (std::size_t i = rollback_k / 2; i > 0; --i) {
-                std::swap(V[inds[2*(i-1)]], V[inds[2*i-1]]);
+            for (std::size_t i = k / 2; i > 0; --i) {
+                swap_cities(inds[2*(i-1)], inds[2*i-1]);
             }
         }
     }
 
+    if (PRINT_STATS) {
+        stats.print(std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+    }
+    if (current < best_cost) {
+        best_cost = current;
+        best_V = V;
+    }
+    V = std::move(best_V);
     output = best_cost;
 }
 
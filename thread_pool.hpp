@@ -0,0 +1,220 @@
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+#include<algorithm>
+#include<atomic>
+#include<condition_variable>
+#include<deque>
+#include<functional>
+#include<memory>
+#include<mutex>
+#include<thread>
+#include<vector>
+
+
+// Tasks submitted together, so that they can be waited for together.
+class TaskGroup {
+    friend class ThreadPool;
+    std::atomic<std::size_t> pending{0};
+};
+
+
+/* Work-stealing thread pool
+ *
+ * Every worker has its own deque of tasks. A task submitted by a worker goes
+ * to the back of its deque and the worker takes its tasks from the back, so
+ * that the subtasks of a task it runs are run first, while they are still
+ * in cache. An idle worker steals from the front of the other deques.
+ *
+ * Background tasks (long running ones, like the local search) wait in a
+ * separate queue which the workers only look at when there is no other
+ * task, so that they never keep a worker from the short tasks the rest of
+ * the computation waits for.
+ *
+ * A thread waiting for a group runs the tasks of the group meanwhile (and
+ * only those, a stolen background task could keep it from returning for
+ * good), so groups can be nested without running out of workers.
+ */
+class ThreadPool {
+    struct Task {
+        std::function<void()> run;
+        TaskGroup * group;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // the pool and the queue of the calling thread, if it is a worker
+    struct Worker {
+        const ThreadPool * pool = nullptr;
+        std::size_t idx = 0;
+    };
+
+    static Worker & current()
+    {
+        static thread_local Worker worker;
+        return worker;
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;  // one per worker
+    Queue background;
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> queued{0};
+    std::atomic<std::size_t> next_queue{0};  // for tasks from outside
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stop = false;  // guarded by sleep_mutex
+
+    // take a task of `group` (of any group if nullptr) out of `queue`, from
+    // the back or the front
+    bool take_from(Queue & queue, bool back, TaskGroup * group, Task & task)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        auto & tasks = queue.tasks;
+        if (tasks.empty()) {
+            return false;
+        }
+        if (group == nullptr) {
+            if (back) {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            } else {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            return true;
+        }
+        for (std::size_t j = 0; j < tasks.size(); j++) {
+            const std::size_t i = back ? tasks.size() - 1 - j : j;
+            if (tasks[i].group == group) {
+                task = std::move(tasks[i]);
+                tasks.erase(tasks.begin() + i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool take(TaskGroup * group, Task & task)
+    {
+        const Worker & worker = current();
+        const std::size_t own = worker.pool == this ? worker.idx : 0;
+        for (std::size_t j = 0; j < queues.size(); j++) {
+            const std::size_t q = (own + j) % queues.size();
+            if (take_from(*queues[q], j == 0 && worker.pool == this, group, task)) {
+                queued--;
+                return true;
+            }
+        }
+        if (take_from(background, false, group, task)) {
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    static void run(Task & task)
+    {
+        task.run();
+        task.group->pending--;
+    }
+
+    void work(std::size_t idx)
+    {
+        current().pool = this;
+        current().idx = idx;
+        Task task;
+        for (;;) {
+            if (take(nullptr, task)) {
+                run(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this]() { return stop || queued.load() > 0; });
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(unsigned int size)
+    {
+        size = std::max(1u, size);
+        for (unsigned int w = 0; w < size; w++) {
+            queues.emplace_back(new Queue());
+        }
+        for (unsigned int w = 0; w < size; w++) {
+            workers.emplace_back(&ThreadPool::work, this, w);
+        }
+    }
+
+    // the queued tasks which have not started are dropped
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    unsigned int size() const
+    {
+        return workers.size();
+    }
+
+    void submit(std::function<void()> fn, TaskGroup & group, bool in_background = false)
+    {
+        group.pending++;
+        const Worker & worker = current();
+        Queue & queue = in_background ? background :
+            worker.pool == this ? *queues[worker.idx] :
+            *queues[next_queue++ % queues.size()];
+        queued++;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(Task{std::move(fn), &group});
+        }
+        {
+            // no worker may be between checking `queued` and sleeping
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        wake.notify_one();
+    }
+
+    // wait for all the tasks of `group`, running them meanwhile
+    void wait(TaskGroup & group)
+    {
+        Task task;
+        while (group.pending.load() > 0) {
+            if (take(&group, task)) {
+                run(task);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // fn(0), ..., fn(count-1) on the pool, fn(0) on the calling thread
+    template<typename fn_t>
+    void parallel_for(unsigned int count, const fn_t & fn)
+    {
+        TaskGroup group;
+        for (unsigned int i = 1; i < count; i++) {
+            submit([&fn, i]() { fn(i); }, group);
+        }
+        if (count > 0) {
+            fn(0);
+        }
+        wait(group);
+    }
+};
+
+#endif
+// vim: set tabstop=4 expandtab shiftwidth=4 softtabstop=4 shiftround
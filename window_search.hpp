@@ -0,0 +1,226 @@
+#ifndef WINDOW_SEARCH_HPP_
+#define WINDOW_SEARCH_HPP_
+
+#include "common.hpp"
+#include "random_perturbations.hpp"
+#include <vector>
+#include <random>
+#include <chrono>
+#include <limits>
+
+// measured on q50 and q100: a window of 13 days is solved in about 6 ms
+constexpr std::size_t MIN_WINDOW{6};  // days of a window at first
+constexpr std::size_t MAX_WINDOW{13};  // memory and time grow as 2^w
+constexpr std::size_t HOTSPOT_SAMPLES{4};  // windows compared by cost
+
+
+// Exact reordering of the cities in a window of the tour.
+//
+// For the window of the w days a..a+w-1 of V, the cities at those positions
+// are reordered optimally, while V[a-1] and V[a+w] stay fixed: dp[S][j] is
+// the cost of the cheapest path from V[a-1] on day a-1 through the window
+// cities in S ending at the j-th of them (|S| days later). The path has to
+// end by an arc to V[a+w] on day a+w-1.
+template<typename costs_t>
+class WindowDP {
+    const costs_t & costs;
+    std::vector<cost_t> dp;  // dp[S * w + j]
+    std::vector<cid_t> cities;  // of the window
+    // arc[(d * w + j) * w + k]: the cost from the j-th to the k-th city on
+    // the day a+d of the window, copied out of costs to be close together
+    std::vector<cost_t> arc;
+
+public:
+    WindowDP(const costs_t & costs) :
+        costs(costs),
+        dp((std::size_t(1) << MAX_WINDOW) * MAX_WINDOW),
+        arc(MAX_WINDOW * MAX_WINDOW * MAX_WINDOW)
+    {}
+
+    // Reorder V[a..a+w-1] optimally, return the change of the cost of V
+    // (0 if the order is kept).
+    cost_t solve(std::vector<cid_t> & V, std::size_t a, std::size_t w)
+    {
+        constexpr cost_t INF = std::numeric_limits<cost_t>::max();
+        const std::size_t full = (std::size_t(1) << w) - 1;
+        cities.assign(V.begin() + a, V.begin() + a + w);
+        cost_t old_cost = 0;
+        for (std::size_t t = a - 1; t < a + w; ++t) {
+            old_cost += costs(t, V[t], V[t+1]);
+        }
+
+        for (std::size_t d = 0; d + 1 < w; ++d) {
+            for (std::size_t j = 0; j < w; ++j) {
+                for (std::size_t k = 0; k < w; ++k) {
+                    arc[(d * w + j) * w + k] = costs(a + d, cities[j], cities[k]);
+                }
+            }
+        }
+
+        std::fill(dp.begin(), dp.begin() + (full + 1) * w, INF);
+        for (std::size_t j = 0; j < w; ++j) {
+            const cost_t cost = costs(a-1, V[a-1], cities[j]);
+            if (cost != NO_ARC) {
+                dp[(std::size_t(1) << j) * w + j] = cost;
+            }
+        }
+        // the day of the arc leaving a path through S is a-1+|S|
+        for (std::size_t S = 1; S < full; ++S) {
+            const std::size_t d = __builtin_popcountll(S) - 1;
+            for (std::size_t j = 0; j < w; ++j) {
+                const cost_t base = dp[S * w + j];
+                if (base == INF) {
+                    continue;
+                }
+                const cost_t * row = &arc[(d * w + j) * w];
+                for (std::size_t k = 0; k < w; ++k) {
+                    if (S >> k & 1) {
+                        continue;
+                    }
+                    const cost_t cost = row[k];
+                    if (cost == NO_ARC) {
+                        continue;
+                    }
+                    cost_t & next = dp[(S | std::size_t(1) << k) * w + k];
+                    next = std::min(next, base + cost);
+                }
+            }
+        }
+
+        cost_t best = INF;
+        std::size_t last = 0;
+        for (std::size_t j = 0; j < w; ++j) {
+            const cost_t cost = costs(a+w-1, cities[j], V[a+w]);
+            if (dp[full * w + j] != INF && cost != NO_ARC && dp[full * w + j] + cost < best) {
+                best = dp[full * w + j] + cost;
+                last = j;
+            }
+        }
+        if (best >= old_cost) {
+            return 0;
+        }
+
+        // walk the optimal path back from its end
+        std::size_t S = full;
+        std::size_t j = last;
+        for (std::size_t p = a + w - 1; ; --p) {
+            V[p] = cities[j];
+            const std::size_t prev_S = S & ~(std::size_t(1) << j);
+            if (prev_S == 0) {
+                break;
+            }
+            for (std::size_t i = 0; i < w; ++i) {
+                if (!(prev_S >> i & 1) || dp[prev_S * w + i] == INF) {
+                    continue;
+                }
+                const cost_t cost = arc[((p - 1 - a) * w + i) * w + j];
+                if (cost != NO_ARC && dp[prev_S * w + i] + cost == dp[S * w + j]) {
+                    j = i;
+                    break;
+                }
+            }
+            S = prev_S;
+        }
+        return best - old_cost;
+    }
+};
+
+
+// Large neighbourhood search: improve the tour V until TERMINATE (expected
+// around `end_time`) by reordering windows of it optimally (WindowDP). A
+// window is either random or the most expensive of HOTSPOT_SAMPLES random
+// ones. The window starts with MIN_WINDOW days and grows by a day whenever
+// about every window of the tour has been tried without an improvement, as
+// long as a solve takes below a 50th of the time left (it shrinks when not).
+//
+// Improvements are published to `elite`. Once the largest windows give none,
+// the search goes on from an elite tour if there is a better one. The best
+// tour is returned in V, its cost in `output`.
+template<typename costs_t>
+void window_search(const std::size_t n,
+                   std::vector<cid_t> & V,
+                   const Graph<costs_t> & graph,
+                   std::chrono::steady_clock::time_point end_time,
+                   ElitePool & elite,
+                   cost_t & output)
+{
+    const costs_t & costs = graph.costs;
+    const auto start_time = std::chrono::steady_clock::now();
+    cost_t current = tour_cost(costs, V);
+    output = current;
+    // some position must stay on each side of the window
+    if (n < 3) {
+        return;
+    }
+    const std::size_t max_window = std::min(MAX_WINDOW, n - 1);
+    std::size_t w = std::min(MIN_WINDOW, max_window);
+
+    WindowDP<costs_t> window(costs);
+    std::random_device rd;
+    std::mt19937 g(rd());
+    std::vector<cid_t> other;
+    std::size_t solved = 0;
+    std::size_t improved = 0;
+    std::size_t fruitless = 0;  // solves since the last improvement
+    std::size_t widest = w;
+
+    while (!TERMINATE.load()) {
+        std::uniform_int_distribution<std::size_t> dis_a(1, n - w);
+        std::size_t a = dis_a(g);
+        if (g() % 2) {
+            cost_t hottest = -1;
+            for (std::size_t i = 0; i < HOTSPOT_SAMPLES; ++i) {
+                const std::size_t b = dis_a(g);
+                cost_t cost = 0;
+                for (std::size_t t = b - 1; t < b + w; ++t) {
+                    cost += costs(t, V[t], V[t+1]);
+                }
+                if (cost > hottest) {
+                    hottest = cost;
+                    a = b;
+                }
+            }
+        }
+
+        const auto solve_start = std::chrono::steady_clock::now();
+        const cost_t delta = window.solve(V, a, w);
+        const auto now = std::chrono::steady_clock::now();
+        solved++;
+        if (delta < 0) {
+            current += delta;
+            improved++;
+            fruitless = 0;
+            elite.publish(V, current);
+            continue;
+        }
+        fruitless++;
+
+        const double solve_seconds = std::chrono::duration<double>(now - solve_start).count();
+        const double left = std::chrono::duration<double>(end_time - now).count();
+        if (solve_seconds > left / 50 && w > 2) {
+            w--;
+            fruitless = 0;
+        } else if (fruitless > n - w) {
+            fruitless = 0;
+            if (w < max_window && 4 * solve_seconds < left / 50) {
+                w++;
+                widest = std::max(widest, w);
+            } else if (elite.draw(g, other) && tour_cost(costs, other) < current) {
+                V.swap(other);
+                current = tour_cost(costs, V);
+            }
+        }
+    }
+
+    if (PRINT_STATS) {
+        const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+        std::ostringstream out;
+        out << "window search: " << solved / seconds << " windows/s, "
+            << improved << " improved, windows up to " << widest << std::endl;
+        std::cerr << out.str();
+    }
+    output = current;
+}
+
+#endif